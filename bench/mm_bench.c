@@ -0,0 +1,598 @@
+/*
+	Copyright 2014 Sky Leonard
+	This file is part of libfluff.
+
+    libfluff is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libfluff is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with libfluff.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Memory manager benchmark
+ *
+ * Runs every allocation pattern against every manager in managers[] and
+ * prints throughput, p50/p99 latency of single calls, and peak RSS. Each run
+ * is a separate process, so peak RSS belongs to that run alone.
+ * Then runs the scaling loop on every thread safe manager with 1, 2, 4...
+ * threads, up to twice the number of online CPUs, and prints throughput and
+ * speedup over one thread.
+ *
+ * Build from the source directory:
+ *   cc -std=gnu99 -O2 -I. -pthread bench/mm_bench.c mm.c mm_slab.c \
+ *       mm_arena.c mm_profile.c data.c -lm -o mm_bench
+ * Usage: mm_bench [scale]
+ *
+ * To measure a new manager, add it to managers[].
+ */
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm.h"
+
+struct Manager {
+	const char * name;
+	const struct FluffMM * const * mm;
+	/* Set if the manager may be used from several threads at once */
+	int thread_safe;
+	/* Called between rounds, for managers that never free single blocks */
+	void (*reset)();
+};
+
+static const struct Manager managers[] = {
+	{"system", &fluff_mm_system, 1, NULL},
+	{"cache", &fluff_mm_cache, 0, NULL},
+	{"cache_threaded", &fluff_mm_cache_threaded, 1, NULL},
+	{"cache_compact", &fluff_mm_cache_compact, 0, NULL},
+	{"slab", &fluff_mm_slab, 1, NULL},
+	{"arena", &fluff_mm_arena, 0, &fluff_mm_arena_reset},
+};
+
+#define N_MANAGERS (sizeof(managers) / sizeof(managers[0]))
+
+/* One call in LATENCY_EVERY is timed on its own */
+#define LATENCY_EVERY 16
+#define LATENCY_MAX (1 << 20)
+
+struct Run {
+	const struct FluffMM * mm;
+	const struct Manager * manager;
+	unsigned long scale;
+	unsigned long long ops;
+	unsigned long long * latency;
+	size_t n_latency;
+	size_t max_latency;
+	uint64_t rand;
+};
+
+static inline unsigned long long now_ns(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint64_t next_rand(uint64_t * state){
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static inline void record(struct Run * run, unsigned long long ns){
+	if (run->n_latency < run->max_latency){
+		run->latency[run->n_latency++] = ns;
+	}
+}
+
+/*
+ * Allocate through run, timing one call in LATENCY_EVERY
+ */
+static inline void * timed_alloc(struct Run * run, union FluffData type){
+	unsigned long long start;
+	void * block;
+
+	if (run->ops++ % LATENCY_EVERY){
+		return run->mm->f_alloc(type);
+	}
+	start = now_ns();
+	block = run->mm->f_alloc(type);
+	record(run, now_ns() - start);
+	return block;
+}
+
+static inline void * timed_alloc_size(struct Run * run, size_t size){
+	unsigned long long start;
+	void * block;
+
+	if (run->ops++ % LATENCY_EVERY){
+		return run->mm->f_alloc_size(size);
+	}
+	start = now_ns();
+	block = run->mm->f_alloc_size(size);
+	record(run, now_ns() - start);
+	return block;
+}
+
+static inline void timed_free(struct Run * run, void * block){
+	unsigned long long start;
+
+	if (run->ops++ % LATENCY_EVERY){
+		run->mm->f_free(block);
+		return;
+	}
+	start = now_ns();
+	run->mm->f_free(block);
+	record(run, now_ns() - start);
+}
+
+static void round_end(struct Run * run){
+	if (run->manager->reset){
+		run->manager->reset();
+	}
+}
+
+/*
+ * Patterns
+ */
+
+#define CHURN_DEPTH 64
+
+/*
+ * Allocate a stack of blocks of one type and free it in reverse, as a
+ * recursive parser or request handler would
+ */
+static void pattern_lifo(struct Run * run){
+	union FluffData type;
+	void * stack[CHURN_DEPTH];
+	unsigned long i;
+	int k, depth;
+
+	type = run->mm->f_type_new(48);
+	for (i = 0; i < run->scale * 2000; ++i){
+		depth = 1 + next_rand(&run->rand) % CHURN_DEPTH;
+		for (k = 0; k < depth; ++k){
+			stack[k] = timed_alloc(run, type);
+		}
+		while (k){
+			timed_free(run, stack[--k]);
+		}
+		round_end(run);
+	}
+	run->mm->f_type_free(type);
+}
+
+#define MIXED_LIVE 4096
+
+/*
+ * Replace random blocks of a live set with blocks of random sizes, mostly
+ * small with a tail of larger ones
+ */
+static void pattern_mixed(struct Run * run){
+	void ** live;
+	unsigned long i;
+	size_t size, k;
+	uint64_t r;
+
+	if (!(live = calloc(MIXED_LIVE, sizeof(void *)))){
+		return;
+	}
+	for (i = 0; i < run->scale * 100000; ++i){
+		r = next_rand(&run->rand);
+		k = r % MIXED_LIVE;
+		size = (r >> 32) % 8 ? 16 + (r >> 40) % 240 : 256 + (r >> 40) % 16128;
+		if (live[k]){
+			timed_free(run, live[k]);
+		}
+		live[k] = timed_alloc_size(run, size);
+		if (run->manager->reset && !(i % MIXED_LIVE)){
+			memset(live, 0, MIXED_LIVE * sizeof(void *));
+			round_end(run);
+		}
+	}
+	for (k = 0; k < MIXED_LIVE; ++k){
+		if (live[k]){
+			run->mm->f_free(live[k]);
+		}
+	}
+	free(live);
+}
+
+#define QUEUE_SIZE 1024
+
+struct Queue {
+	void * slots[QUEUE_SIZE];
+	unsigned long head;
+	unsigned long tail;
+	unsigned long total;
+	struct Run * consumer;
+};
+
+static void * consumer_main(void * data){
+	struct Queue * queue;
+	unsigned long i, head;
+	void * block;
+
+	queue = data;
+	for (i = 0; i < queue->total; ++i){
+		while ((head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
+				== queue->tail){
+			sched_yield();
+		}
+		block = queue->slots[queue->tail % QUEUE_SIZE];
+		__atomic_store_n(&queue->tail, queue->tail + 1, __ATOMIC_RELEASE);
+		timed_free(queue->consumer, block);
+	}
+	return NULL;
+}
+
+/*
+ * One thread allocates, another frees, as with buffers handed from a
+ * network thread to workers
+ */
+static void pattern_producer_consumer(struct Run * run){
+	struct Queue * queue;
+	struct Run consumer;
+	pthread_t thread;
+	union FluffData type;
+	unsigned long i;
+	void * block;
+
+	if (!run->manager->thread_safe){
+		run->ops = 0;
+		return;
+	}
+	if (!(queue = calloc(1, sizeof(struct Queue)))){
+		return;
+	}
+	/* Each thread keeps its samples in its own half of the buffer */
+	run->max_latency = LATENCY_MAX / 2;
+	consumer = *run;
+	consumer.ops = 0;
+	consumer.latency = run->latency + LATENCY_MAX / 2;
+	queue->total = run->scale * 100000;
+	queue->consumer = &consumer;
+	type = run->mm->f_type_new(256);
+	pthread_create(&thread, NULL, &consumer_main, queue);
+	for (i = 0; i < queue->total; ++i){
+		block = timed_alloc(run, type);
+		memset(block, 0, 64);
+		while (i - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)
+				>= QUEUE_SIZE){
+			sched_yield();
+		}
+		queue->slots[i % QUEUE_SIZE] = block;
+		__atomic_store_n(&queue->head, i + 1, __ATOMIC_RELEASE);
+	}
+	pthread_join(thread, NULL);
+	run->mm->f_type_free(type);
+	memmove(run->latency + run->n_latency, consumer.latency,
+			consumer.n_latency * sizeof(unsigned long long));
+	run->n_latency += consumer.n_latency;
+	run->ops += consumer.ops;
+	free(queue);
+}
+
+#define BURST_MAX 2048
+#define BURST_BUFFERS 4
+
+struct Connection {
+	char handle[160];
+	void * buffers[BURST_BUFFERS];
+};
+
+/*
+ * Bursts of connections arrive, each with a handle and a few buffers, and
+ * leave in random order
+ */
+static void pattern_bursty(struct Run * run){
+	union FluffData type;
+	struct Connection ** conns, * conn;
+	unsigned long i;
+	size_t n, k, j;
+
+	if (!(conns = malloc(BURST_MAX * sizeof(struct Connection *)))){
+		return;
+	}
+	type = run->mm->f_type_new(sizeof(struct Connection));
+	for (i = 0; i < run->scale * 40; ++i){
+		n = 1 + next_rand(&run->rand) % BURST_MAX;
+		for (k = 0; k < n; ++k){
+			conns[k] = conn = timed_alloc(run, type);
+			for (j = 0; j < BURST_BUFFERS; ++j){
+				conn->buffers[j] = timed_alloc_size(
+						run, 64 + next_rand(&run->rand) % 4032);
+			}
+		}
+		while (n){
+			k = next_rand(&run->rand) % n;
+			conn = conns[k];
+			conns[k] = conns[--n];
+			for (j = 0; j < BURST_BUFFERS; ++j){
+				timed_free(run, conn->buffers[j]);
+			}
+			timed_free(run, conn);
+		}
+		round_end(run);
+	}
+	run->mm->f_type_free(type);
+	free(conns);
+}
+
+struct Pattern {
+	const char * name;
+	void (*run)(struct Run *);
+};
+
+static const struct Pattern patterns[] = {
+	{"lifo", &pattern_lifo},
+	{"mixed", &pattern_mixed},
+	{"producer_consumer", &pattern_producer_consumer},
+	{"bursty", &pattern_bursty},
+};
+
+#define N_PATTERNS (sizeof(patterns) / sizeof(patterns[0]))
+
+/*
+ * Scaling
+ * Every thread allocates and frees blocks of a shared type and of
+ * f_alloc_size sizes, keeping a small live set of its own. One block in
+ * SCALING_PASS_EVERY is swapped into the next thread's mailbox instead, and
+ * the block found there is freed, so frees from other threads are part of
+ * the load as they are in real programs.
+ */
+
+#define SCALING_LIVE 64
+#define SCALING_PASS_EVERY 64
+#define SCALING_MAX_THREADS 256
+
+struct Scaling {
+	const struct FluffMM * mm;
+	union FluffData type;
+	unsigned long iterations;
+	int n_threads;
+	pthread_barrier_t start;
+	/* Each on its own cache line, so passing blocks does not false share */
+	struct {
+		void * block;
+		char pad[64 - sizeof(void *)];
+	} mailbox[SCALING_MAX_THREADS];
+};
+
+struct ScalingThread {
+	struct Scaling * scaling;
+	int id;
+};
+
+static void * scaling_main(void * data){
+	struct ScalingThread * self;
+	struct Scaling * scaling;
+	const struct FluffMM * mm;
+	void * live[SCALING_LIVE], * block;
+	unsigned long i;
+	uint64_t rand, r;
+	size_t k;
+
+	self = data;
+	scaling = self->scaling;
+	mm = scaling->mm;
+	rand = 0x9E3779B97F4A7C15ull * (self->id + 1);
+	memset(live, 0, sizeof(live));
+	pthread_barrier_wait(&scaling->start);
+	for (i = 0; i < scaling->iterations; ++i){
+		r = next_rand(&rand);
+		k = r % SCALING_LIVE;
+		if ((block = live[k])){
+			if (!((r >> 16) % SCALING_PASS_EVERY)){
+				block = __atomic_exchange_n(
+						&scaling->mailbox[(self->id + 1) % scaling->n_threads]
+						.block, block, __ATOMIC_ACQ_REL);
+			}
+			if (block){
+				mm->f_free(block);
+			}
+		}
+		live[k] = (r >> 32) % 2 ? mm->f_alloc(scaling->type)
+				: mm->f_alloc_size(16 + (r >> 40) % 1008);
+	}
+	for (k = 0; k < SCALING_LIVE; ++k){
+		if (live[k]){
+			mm->f_free(live[k]);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Run the scaling loop with n_threads threads
+ * Return the throughput in Mops/s
+ */
+static double scaling_run(const struct Manager * manager,
+		unsigned long scale, int n_threads){
+	struct Scaling * scaling;
+	struct ScalingThread threads[SCALING_MAX_THREADS];
+	pthread_t ids[SCALING_MAX_THREADS];
+	unsigned long long start, elapsed;
+	int i, started;
+
+	if (!(scaling = calloc(1, sizeof(struct Scaling)))){
+		return 0;
+	}
+	scaling->mm = *manager->mm;
+	scaling->type = scaling->mm->f_type_new(64);
+	scaling->iterations = scale * 100000;
+	scaling->n_threads = n_threads;
+	pthread_barrier_init(&scaling->start, NULL, n_threads + 1);
+	for (started = 0; started < n_threads; ++started){
+		threads[started].scaling = scaling;
+		threads[started].id = started;
+		if (pthread_create(ids + started, NULL,
+				&scaling_main, threads + started)){
+			break;
+		}
+	}
+	if (started < n_threads){
+		/* The barrier can never open, so the run cannot go on */
+		fprintf(stderr, "pthread_create failed\n");
+		_exit(1);
+	}
+	pthread_barrier_wait(&scaling->start);
+	start = now_ns();
+	for (i = 0; i < n_threads; ++i){
+		pthread_join(ids[i], NULL);
+	}
+	elapsed = now_ns() - start;
+	for (i = 0; i < n_threads; ++i){
+		if (scaling->mailbox[i].block){
+			scaling->mm->f_free(scaling->mailbox[i].block);
+		}
+	}
+	scaling->mm->f_type_free(scaling->type);
+	pthread_barrier_destroy(&scaling->start);
+	free(scaling);
+	/* Each iteration allocates once and frees about once */
+	return 2.0 * n_threads * scale * 100000 * 1000.0 / elapsed;
+}
+
+/*
+ * Print the scaling of every thread safe manager, each thread count in a
+ * process of its own
+ */
+static int scaling(unsigned long scale){
+	const struct Manager * manager;
+	int fds[2], max_threads, n;
+	double base, mops;
+	size_t m;
+	pid_t pid;
+
+	max_threads = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+	if (max_threads > SCALING_MAX_THREADS){
+		max_threads = SCALING_MAX_THREADS;
+	}
+	printf("\n%-18s %-16s %10s %8s\n", "threads", "manager",
+			"Mops/s", "speedup");
+	fflush(stdout);
+	for (m = 0; m < N_MANAGERS; ++m){
+		manager = managers + m;
+		if (!manager->thread_safe){
+			continue;
+		}
+		base = 0;
+		for (n = 1; n <= max_threads; n *= 2){
+			if (pipe(fds)){
+				perror("pipe");
+				return -1;
+			}
+			if ((pid = fork()) < 0){
+				perror("fork");
+				return -1;
+			}
+			if (!pid){
+				close(fds[0]);
+				mops = scaling_run(manager, scale, n);
+				if (write(fds[1], &mops, sizeof(mops)) != sizeof(mops)){
+					_exit(1);
+				}
+				_exit(0);
+			}
+			close(fds[1]);
+			if (read(fds[0], &mops, sizeof(mops)) != sizeof(mops)){
+				mops = 0;
+			}
+			close(fds[0]);
+			waitpid(pid, NULL, 0);
+			if (n == 1){
+				base = mops;
+			}
+			printf("%-18d %-16s %10.2f %8.2f\n", n, manager->name,
+					mops, base ? mops / base : 0);
+			fflush(stdout);
+		}
+	}
+	return 0;
+}
+
+static int compare_ull(const void * a, const void * b){
+	unsigned long long x, y;
+
+	x = *(const unsigned long long *)a;
+	y = *(const unsigned long long *)b;
+	return (x > y) - (x < y);
+}
+
+static void bench(const struct Pattern * pattern,
+		const struct Manager * manager, unsigned long scale){
+	struct Run run;
+	struct rusage usage;
+	unsigned long long start, elapsed;
+	unsigned long long p50, p99;
+
+	memset(&run, 0, sizeof(struct Run));
+	run.mm = *manager->mm;
+	run.manager = manager;
+	run.scale = scale;
+	run.rand = 0x9E3779B97F4A7C15ull;
+	run.max_latency = LATENCY_MAX;
+	if (!(run.latency = malloc(LATENCY_MAX * sizeof(unsigned long long)))){
+		return;
+	}
+	start = now_ns();
+	pattern->run(&run);
+	elapsed = now_ns() - start;
+	if (!run.ops){
+		printf("%-18s %-16s %10s\n", pattern->name, manager->name, "skipped");
+		free(run.latency);
+		return;
+	}
+	qsort(run.latency, run.n_latency, sizeof(unsigned long long),
+			&compare_ull);
+	p50 = run.n_latency ? run.latency[run.n_latency / 2] : 0;
+	p99 = run.n_latency ? run.latency[run.n_latency * 99 / 100] : 0;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("%-18s %-16s %10.2f %8llu %8llu %10ld\n",
+			pattern->name, manager->name,
+			run.ops * 1000.0 / elapsed, p50, p99, usage.ru_maxrss);
+	free(run.latency);
+}
+
+int main(int argc, char ** argv){
+	unsigned long scale;
+	size_t p, m;
+	pid_t pid;
+
+	scale = argc > 1 ? strtoul(argv[1], NULL, 10) : 10;
+	printf("%-18s %-16s %10s %8s %8s %10s\n", "pattern", "manager",
+			"Mops/s", "p50 ns", "p99 ns", "RSS KiB");
+	fflush(stdout);
+	for (p = 0; p < N_PATTERNS; ++p){
+		for (m = 0; m < N_MANAGERS; ++m){
+			if ((pid = fork()) < 0){
+				perror("fork");
+				return 1;
+			}
+			if (!pid){
+				bench(patterns + p, managers + m, scale);
+				fflush(stdout);
+				_exit(0);
+			}
+			waitpid(pid, NULL, 0);
+		}
+	}
+	return scaling(scale) ? 1 : 0;
+}
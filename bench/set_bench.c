@@ -0,0 +1,231 @@
+/*
+	Copyright 2014 Sky Leonard
+	This file is part of libfluff.
+
+    libfluff is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libfluff is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with libfluff.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Hash set benchmark
+ *
+ * Adds scale keys of each kind in keysets[] to a hash set, looks each up
+ * again, one at a time and then all at once with
+ * fluff_set_hash_contains_many, looks up as many keys which are not in the
+ * set, then removes them all, and prints the average time of each operation
+ * in nanoseconds. Each kind is run twice: once picking groups as the set
+ * does, from the mixed hash with a mask, and once with the unmixed hash
+ * % size it used before, see FLUFF_SET_HASH_MODULO in set.c.
+ * Lookups and removes go in a random order, so keys whose hashes follow
+ * each other do not get an unfair boost from the cache. Several key kinds
+ * come with weak hash functions, to show how bucket selection copes with
+ * hashes whose low or high bits barely vary.
+ *
+ * set.c is included to switch group selection, so build it from the source
+ * directory without set.c:
+ *   cc -std=gnu99 -O2 -I. -pthread bench/set_bench.c bitwords.c mm.c \
+ *       data.c -o set_bench
+ * Usage: set_bench [scale]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FLUFF_SET_HASH_MODULO
+#include "set.c"
+
+struct KeySet {
+	const char * name;
+	/* Store key i of the set in dest */
+	void (*make)(unsigned long i, union FluffData * dest);
+	FluffHashFunction hash;
+	FluffEqualFunction equal;
+	/* Free the keys made by make, or NULL */
+	void (*free)(union FluffData);
+};
+
+static void make_int(unsigned long i, union FluffData * dest){
+	*dest = fluff_data_zero;
+	dest->d_uint32_t = i;
+}
+
+/*
+ * Values which only differ above their low 10 bits
+ */
+static void make_high(unsigned long i, union FluffData * dest){
+	*dest = fluff_data_zero;
+	dest->d_uint32_t = i << 10;
+}
+
+/*
+ * Addresses of 64 byte objects, whose low 6 bits are always 0
+ */
+static void make_ptr(unsigned long i, union FluffData * dest){
+	*dest = fluff_data_zero;
+	dest->d_uint64_t = 0x7f0000000000ull + i * 64;
+}
+
+static void make_str(unsigned long i, union FluffData * dest){
+	*dest = fluff_data_zero;
+	if ((dest->d_str = malloc(24))){
+		snprintf(dest->d_str, 24, "key:%lu", i);
+	}
+}
+
+static FluffHashValue hash_identity(union FluffData data){
+	return data.d_uint32_t;
+}
+
+static FluffHashValue hash_ptr(union FluffData data){
+	return (FluffHashValue)data.d_uint64_t;
+}
+
+static int equal_int(union FluffData a, union FluffData b){
+	return a.d_uint64_t == b.d_uint64_t;
+}
+
+static int equal_str(union FluffData a, union FluffData b){
+	return !strcmp(a.d_str, b.d_str);
+}
+
+static void free_str(union FluffData data){
+	free(data.d_str);
+}
+
+static struct KeySet keysets[5];
+
+static void keysets_init(){
+	struct KeySet sets[] = {
+		{"uint32 mixed", &make_int, fluff_hash_uint32_t, &equal_int, NULL},
+		{"uint32 identity", &make_int, &hash_identity, &equal_int, NULL},
+		{"uint32 high bits", &make_high, &hash_identity, &equal_int, NULL},
+		{"pointer low bits", &make_ptr, &hash_ptr, &equal_int, NULL},
+		{"string djb2", &make_str, fluff_hash_str, &equal_str, &free_str},
+	};
+
+	memcpy(keysets, sets, sizeof(sets));
+}
+
+#define N_KEYSETS (sizeof(keysets) / sizeof(keysets[0]))
+
+static inline unsigned long long now_ns(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint64_t next_rand(uint64_t * state){
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static void run(struct KeySet * keyset, unsigned long scale){
+	struct FluffSetHash * set;
+	union FluffData * keys, * shuffled, swap;
+	unsigned long long start, add, hit, batch, miss, rem;
+	uint64_t * bits;
+	unsigned long i, j, found, batched;
+	uint64_t rand;
+
+	/* Keys scale to 2 * scale are never added, for the misses */
+	keys = malloc(2 * scale * sizeof(union FluffData));
+	shuffled = malloc(2 * scale * sizeof(union FluffData));
+	bits = malloc((scale + 63) / 64 * sizeof(uint64_t));
+	if (!keys || !shuffled || !bits){
+		free(keys);
+		free(shuffled);
+		free(bits);
+		return;
+	}
+	for (i = 0; i < 2 * scale; ++i){
+		keyset->make(i, keys + i);
+		shuffled[i] = keys[i];
+	}
+	/* Shuffle the added keys and the missing keys separately */
+	rand = 0x9E3779B97F4A7C15ull;
+	for (i = 0; i < 2 * scale; ++i){
+		j = (i < scale ? 0 : scale) + next_rand(&rand) % (i % scale + 1);
+		swap = shuffled[i];
+		shuffled[i] = shuffled[j];
+		shuffled[j] = swap;
+	}
+	if (!(set = fluff_set_hash_new(keyset->hash, keyset->equal))){
+		free(keys);
+		free(shuffled);
+		free(bits);
+		return;
+	}
+	start = now_ns();
+	for (i = 0; i < scale; ++i){
+		fluff_set_hash_add(set, keys[i]);
+	}
+	add = now_ns() - start;
+	found = 0;
+	start = now_ns();
+	for (i = 0; i < scale; ++i){
+		found += fluff_set_hash_contains(set, shuffled[i]);
+	}
+	hit = now_ns() - start;
+	start = now_ns();
+	batched = fluff_set_hash_contains_many(set, shuffled, scale, bits);
+	batch = now_ns() - start;
+	start = now_ns();
+	for (i = scale; i < 2 * scale; ++i){
+		found += fluff_set_hash_contains(set, shuffled[i]);
+	}
+	miss = now_ns() - start;
+	start = now_ns();
+	for (i = 0; i < scale; ++i){
+		fluff_set_hash_remove(set, shuffled[i]);
+	}
+	rem = now_ns() - start;
+	printf("%-18s %-7s %8.1f %8.1f %8.1f %8.1f %8.1f%s\n", keyset->name,
+			set_hash_modulo ? "modulo" : "mask", (double)add / scale, (double)hit / scale, (double)batch / scale,
+			(double)miss / scale, (double)rem / scale,
+			found == scale && batched == scale ? "" : "  (wrong result)");
+	fluff_set_hash_free(set, NULL);
+	if (keyset->free){
+		for (i = 0; i < 2 * scale; ++i){
+			keyset->free(keys[i]);
+		}
+	}
+	free(keys);
+	free(shuffled);
+	free(bits);
+}
+
+int main(int argc, char ** argv){
+	unsigned long scale;
+	size_t i;
+
+	scale = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+	if (!scale){
+		fprintf(stderr, "usage: %s [scale]\n", argv[0]);
+		return 1;
+	}
+	keysets_init();
+	printf("%lu keys, ns per operation\n", scale);
+	printf("%-18s %-7s %8s %8s %8s %8s %8s\n",
+			"keys", "groups", "add", "hit", "batch", "miss", "remove");
+	for (i = 0; i < N_KEYSETS; ++i){
+		set_hash_modulo = 0;
+		run(keysets + i, scale);
+		set_hash_modulo = 1;
+		run(keysets + i, scale);
+	}
+	return 0;
+}
@@ -0,0 +1,187 @@
+/*
+	Copyright 2014 Sky Leonard
+	This file is part of libfluff.
+
+    libfluff is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libfluff is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with libfluff.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Hash set probe check
+ *
+ * The control byte of a slot only spares a comparison if it tells values of
+ * one group apart, which it cannot once the bits picking the group reach
+ * the bits making the byte. For table sizes up to 2^29 slots, random
+ * hashes are sorted by group, and the share of pairs in one group which
+ * also share a control byte is compared with 1/128, the share for
+ * independent bits. Then scale keys are added to a real set, by default
+ * enough for a table of 2^26 slots, and lookups of keys which are not in it
+ * count the slots whose control byte matched against the occupied slots
+ * they scanned, along with the groups probed.
+ * Exits with status 1 if a share is over 1.5/128.
+ *
+ * set.c is included to reach the table, so build it from the source
+ * directory without set.c:
+ *   cc -std=gnu99 -O2 -I. -pthread bench/set_probe.c bitwords.c mm.c \
+ *       data.c -o set_probe
+ * Usage: set_probe [scale]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "set.c"
+
+#define SAMPLES ((size_t)1 << 22)
+#define MISSES ((unsigned long)1 << 20)
+#define SHARE_LIMIT (1.5 / 128)
+
+static inline uint64_t next_rand(uint64_t * state){
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static int compare_u64(const void * a, const void * b){
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Share of pairs of random hashes in one group of a table of size slots
+ * whose control bytes are equal
+ */
+static double tag_share(uint64_t * keys, size_t size){
+	struct HashTable table;
+	uint64_t rand, pairs, equal, group_run, tag_run;
+	FluffHashValue hash;
+	size_t i;
+
+	table.size = size;
+	rand = 0x9E3779B97F4A7C15ull;
+	for (i = 0; i < SAMPLES; ++i){
+		hash = (FluffHashValue)next_rand(&rand);
+		keys[i] = (uint64_t)(GROUP_START(&table, hash) / GROUP_SIZE) << 8
+				| (uint8_t)CTRL_HASH(hash);
+	}
+	qsort(keys, SAMPLES, sizeof(uint64_t), &compare_u64);
+	pairs = equal = 0;
+	group_run = tag_run = 1;
+	for (i = 1; i <= SAMPLES; ++i){
+		if (i < SAMPLES && keys[i] == keys[i - 1]){
+			tag_run += 1;
+		} else {
+			equal += tag_run * (tag_run - 1) / 2;
+			tag_run = 1;
+		}
+		if (i < SAMPLES && keys[i] >> 8 == keys[i - 1] >> 8){
+			group_run += 1;
+		} else {
+			pairs += group_run * (group_run - 1) / 2;
+			group_run = 1;
+		}
+	}
+	return pairs ? (double)equal / pairs : 0;
+}
+
+static int check_tags(){
+	uint64_t * keys;
+	double share;
+	int shift, failed;
+
+	if (!(keys = malloc(SAMPLES * sizeof(uint64_t)))){
+		return 1;
+	}
+	failed = 0;
+	printf("%-12s %14s\n", "slots", "share x 128");
+	for (shift = 20; shift <= 29; ++shift){
+		share = tag_share(keys, (size_t)1 << shift);
+		printf("2^%-10d %14.3f%s\n", shift, share * 128,
+				share > SHARE_LIMIT ? "  (too high)" : "");
+		failed |= share > SHARE_LIMIT;
+	}
+	free(keys);
+	return failed;
+}
+
+/*
+ * Walk the groups a lookup of a missing hash visits, as table_find does
+ */
+static void probe_miss(struct HashTable * table, FluffHashValue hash,
+		unsigned long long * groups, unsigned long long * occupied,
+		unsigned long long * matched){
+	size_t pos, step;
+
+	pos = GROUP_START(table, hash);
+	for (step = GROUP_SIZE; ; step += GROUP_SIZE){
+		*groups += 1;
+		*occupied += GROUP_SIZE
+				- __builtin_popcount(group_match_free(table->ctrl + pos));
+		*matched += __builtin_popcount(
+				group_match(table->ctrl + pos, CTRL_HASH(hash)));
+		if (group_match(table->ctrl + pos, CTRL_EMPTY)){
+			return;
+		}
+		pos = (pos + step) & (table->size - 1);
+	}
+}
+
+static int equal_int(union FluffData a, union FluffData b){
+	return a.d_uint32_t == b.d_uint32_t;
+}
+
+static int check_table(unsigned long scale){
+	struct FluffSetHash * set;
+	union FluffData data;
+	unsigned long long groups, occupied, matched;
+	unsigned long i;
+	double share;
+
+	if (!(set = fluff_set_hash_new(fluff_hash_uint32_t, &equal_int))){
+		return 1;
+	}
+	data = fluff_data_zero;
+	for (i = 0; i < scale; ++i){
+		data.d_uint32_t = i;
+		fluff_set_hash_add(set, data);
+	}
+	groups = occupied = matched = 0;
+	for (i = 0; i < MISSES; ++i){
+		data.d_uint32_t = scale + i;
+		probe_miss(&set->table, set_hash_of(set, data),
+				&groups, &occupied, &matched);
+	}
+	share = occupied ? (double)matched / occupied : 0;
+	printf("%lu keys in 2^%d slots, per miss: %.3f groups, "
+			"%.3f slots compared, share x 128 %.3f%s\n",
+			scale, __builtin_ctzl(set->table.size),
+			(double)groups / MISSES, (double)matched / MISSES, share * 128,
+			share > SHARE_LIMIT ? "  (too high)" : "");
+	fluff_set_hash_free(set, NULL);
+	return share > SHARE_LIMIT;
+}
+
+int main(int argc, char ** argv){
+	unsigned long scale;
+	int failed;
+
+	scale = argc > 1 ? strtoul(argv[1], NULL, 0) : 30000000;
+	if (!scale || scale > UINT32_MAX - MISSES){
+		fprintf(stderr, "usage: %s [scale]\n", argv[0]);
+		return 1;
+	}
+	failed = check_tags();
+	failed |= check_table(scale);
+	return failed;
+}
@@ -0,0 +1,213 @@
+/*
+	Copyright 2014 Sky Leonard
+	This file is part of libfluff.
+
+    libfluff is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libfluff is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with libfluff.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "bitwords.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define BITWORDS_AVX2
+#include <immintrin.h>
+#endif
+
+/*
+ * Scalar operations
+ */
+#define SCALAR_OP(name, OP) \
+static size_t name(uint64_t * dest, \
+		const uint64_t * a, const uint64_t * b, size_t n){ \
+	size_t i, count; \
+	\
+	count = 0; \
+	for (i = 0; i < n; ++i){ \
+		dest[i] = OP(a[i], b[i]); \
+		count += __builtin_popcountll(dest[i]); \
+	} \
+	return count; \
+}
+
+#define WORD_OR(a, b) ((a) | (b))
+#define WORD_AND(a, b) ((a) & (b))
+#define WORD_ANDNOT(a, b) ((a) & ~(b))
+#define WORD_XOR(a, b) ((a) ^ (b))
+
+SCALAR_OP(scalar_or, WORD_OR)
+SCALAR_OP(scalar_and, WORD_AND)
+SCALAR_OP(scalar_andnot, WORD_ANDNOT)
+SCALAR_OP(scalar_xor, WORD_XOR)
+
+static size_t scalar_popcount(const uint64_t * words, size_t n){
+	size_t i, count;
+
+	count = 0;
+	for (i = 0; i < n; ++i){
+		count += __builtin_popcountll(words[i]);
+	}
+	return count;
+}
+
+static int scalar_subset(const uint64_t * a, const uint64_t * b, size_t n){
+	size_t i;
+
+	for (i = 0; i < n; ++i){
+		if (a[i] & ~b[i]){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int scalar_disjoint(const uint64_t * a, const uint64_t * b, size_t n){
+	size_t i;
+
+	for (i = 0; i < n; ++i){
+		if (a[i] & b[i]){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+const struct FluffBitWords bitwords_scalar = {
+		&scalar_or,
+		&scalar_and,
+		&scalar_andnot,
+		&scalar_xor,
+		&scalar_popcount,
+		&scalar_subset,
+		&scalar_disjoint,
+};
+
+const struct FluffBitWords * const fluff_bitwords_scalar = &bitwords_scalar;
+
+#ifdef BITWORDS_AVX2
+
+/*
+ * AVX2 operations
+ * Bits are counted a nibble at a time with a shuffle lookup, and the byte
+ * counts summed into 64 bit lanes, so counting keeps pace with the loads.
+ * Words past the last multiple of 4 are left to the scalar operations
+ */
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256i avx2_popcount_lanes(__m256i v){
+	const __m256i table = _mm256_setr_epi8(
+			0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+			0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0f);
+	__m256i counts;
+
+	counts = _mm256_add_epi8(
+			_mm256_shuffle_epi8(table, _mm256_and_si256(v, low)),
+			_mm256_shuffle_epi8(table,
+					_mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+	return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+}
+
+static inline AVX2 size_t avx2_sum_lanes(__m256i v){
+	return _mm256_extract_epi64(v, 0) + _mm256_extract_epi64(v, 1)
+			+ _mm256_extract_epi64(v, 2) + _mm256_extract_epi64(v, 3);
+}
+
+#define AVX2_OP(name, VOP, scalar) \
+static AVX2 size_t name(uint64_t * dest, \
+		const uint64_t * a, const uint64_t * b, size_t n){ \
+	__m256i v, total; \
+	size_t i; \
+	\
+	total = _mm256_setzero_si256(); \
+	for (i = 0; i + 4 <= n; i += 4){ \
+		v = VOP(_mm256_loadu_si256((const __m256i *)(a + i)), \
+				_mm256_loadu_si256((const __m256i *)(b + i))); \
+		_mm256_storeu_si256((__m256i *)(dest + i), v); \
+		total = _mm256_add_epi64(total, avx2_popcount_lanes(v)); \
+	} \
+	return avx2_sum_lanes(total) + scalar(dest + i, a + i, b + i, n - i); \
+}
+
+/* _mm256_andnot_si256 complements its first operand */
+#define VEC_ANDNOT(a, b) _mm256_andnot_si256((b), (a))
+
+AVX2_OP(avx2_or, _mm256_or_si256, scalar_or)
+AVX2_OP(avx2_and, _mm256_and_si256, scalar_and)
+AVX2_OP(avx2_andnot, VEC_ANDNOT, scalar_andnot)
+AVX2_OP(avx2_xor, _mm256_xor_si256, scalar_xor)
+
+static AVX2 size_t avx2_popcount(const uint64_t * words, size_t n){
+	__m256i total;
+	size_t i;
+
+	total = _mm256_setzero_si256();
+	for (i = 0; i + 4 <= n; i += 4){
+		total = _mm256_add_epi64(total, avx2_popcount_lanes(
+				_mm256_loadu_si256((const __m256i *)(words + i))));
+	}
+	return avx2_sum_lanes(total) + scalar_popcount(words + i, n - i);
+}
+
+static AVX2 int avx2_subset(const uint64_t * a, const uint64_t * b, size_t n){
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4){
+		if (!_mm256_testc_si256(
+				_mm256_loadu_si256((const __m256i *)(b + i)),
+				_mm256_loadu_si256((const __m256i *)(a + i)))){
+			return 0;
+		}
+	}
+	return scalar_subset(a + i, b + i, n - i);
+}
+
+static AVX2 int avx2_disjoint(const uint64_t * a, const uint64_t * b, size_t n){
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4){
+		if (!_mm256_testz_si256(
+				_mm256_loadu_si256((const __m256i *)(a + i)),
+				_mm256_loadu_si256((const __m256i *)(b + i)))){
+			return 0;
+		}
+	}
+	return scalar_disjoint(a + i, b + i, n - i);
+}
+
+const struct FluffBitWords bitwords_avx2 = {
+		&avx2_or,
+		&avx2_and,
+		&avx2_andnot,
+		&avx2_xor,
+		&avx2_popcount,
+		&avx2_subset,
+		&avx2_disjoint,
+};
+
+const struct FluffBitWords * const fluff_bitwords_avx2 = &bitwords_avx2;
+
+#else
+
+const struct FluffBitWords * const fluff_bitwords_avx2 = NULL;
+
+#endif /* BITWORDS_AVX2 */
+
+const struct FluffBitWords * fluff_bitwords = &bitwords_scalar;
+
+static void __attribute__((constructor)) init_bitwords(){
+#ifdef BITWORDS_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")){
+		fluff_bitwords = &bitwords_avx2;
+	}
+#endif
+}
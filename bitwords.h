@@ -0,0 +1,72 @@
+/*
+	Copyright 2014 Sky Leonard
+	This file is part of libfluff.
+
+    libfluff is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libfluff is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with libfluff.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FLUFF_BITWORDS_H_
+#define FLUFF_BITWORDS_H_
+
+#include "config_types.h"
+
+/*
+ * Operations on arrays of 64 bit words used as bitmaps, as used by the sets
+ * Arrays may not overlap unless dest is one of the sources
+ */
+struct FluffBitWords {
+	/*
+	 * Store a | b, a & b, a & ~b or a ^ b of n words into dest
+	 * Return the number of bits set in dest
+	 */
+	size_t (*f_or)(uint64_t * dest,
+			const uint64_t * a, const uint64_t * b, size_t n);
+	size_t (*f_and)(uint64_t * dest,
+			const uint64_t * a, const uint64_t * b, size_t n);
+	size_t (*f_andnot)(uint64_t * dest,
+			const uint64_t * a, const uint64_t * b, size_t n);
+	size_t (*f_xor)(uint64_t * dest,
+			const uint64_t * a, const uint64_t * b, size_t n);
+	/*
+	 * Return the number of bits set in n words
+	 */
+	size_t (*f_popcount)(const uint64_t *, size_t n);
+	/*
+	 * Return 1 if every bit set in n words of a is set in b, otherwise 0
+	 */
+	int (*f_subset)(const uint64_t * a, const uint64_t * b, size_t n);
+	/*
+	 * Return 1 if no bit is set in n words of both a and b, otherwise 0
+	 */
+	int (*f_disjoint)(const uint64_t * a, const uint64_t * b, size_t n);
+};
+
+/*
+ * Fastest operations the processor supports, chosen when the library is
+ * loaded
+ */
+extern const struct FluffBitWords * fluff_bitwords;
+
+/*
+ * Portable operations, one word at a time
+ */
+extern const struct FluffBitWords * const fluff_bitwords_scalar;
+
+/*
+ * Operations using AVX2, 4 words at a time
+ * NULL if the library was built for a processor without them
+ */
+extern const struct FluffBitWords * const fluff_bitwords_avx2;
+
+#endif /* FLUFF_BITWORDS_H_ */
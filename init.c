@@ -0,0 +1,46 @@
+/*
+	Copyright 2014 Sky Leonard
+	This file is part of libfluff.
+
+    libfluff is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libfluff is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with libfluff.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "init.h"
+
+#include <pthread.h>
+
+#include "network.h"
+#include "packet.h"
+#include "random.h"
+#include "set.h"
+#include "socket.h"
+#include "struct.h"
+
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void fluff_init(){
+	fluff_init_with_mm(fluff_mm_default);
+}
+
+void fluff_init_with_mm(const struct FluffMM * mm){
+	pthread_mutex_lock(&init_lock);
+	fluff_mm_default = mm;
+	fluff_set_setmm(mm);
+	fluff_set_roaring_setmm(mm);
+	fluff_socket_setmm(mm);
+	fluff_network_setmm(mm);
+	fluff_packet_setmm(mm);
+	fluff_random_setmm(mm);
+	fluff_struct_setmm(mm);
+	pthread_mutex_unlock(&init_lock);
+}
@@ -0,0 +1,44 @@
+/*
+	Copyright 2014 Sky Leonard
+	This file is part of libfluff.
+
+    libfluff is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libfluff is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with libfluff.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FLUFF_INIT_H_
+#define FLUFF_INIT_H_
+
+#include "mm.h"
+
+/*
+ * Every module sets up its memory manager when the library is loaded, using
+ * fluff_mm_default. Assigning fluff_mm_default afterwards does not change
+ * the modules by itself: call fluff_init after assigning it, or use
+ * fluff_init_with_mm. These functions set up every module again, and should
+ * be called before any object is created and before other threads use the
+ * library
+ */
+
+/*
+ * Set up every module with fluff_mm_default
+ */
+void fluff_init();
+
+/*
+ * Make a memory manager the default and set up every module with it
+ * The traceback functions keep their own manager
+ */
+void fluff_init_with_mm(const struct FluffMM *);
+
+#endif /* FLUFF_INIT_H_ */
@@ -17,21 +17,73 @@
 */
 #include "mm.h"
 
+#include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 
-static union FluffData system_type_new(size_t size){
+/*
+ * A system type, aligned blocks come from posix_memalign
+ */
+struct SystemType {
+	size_t size;
+	size_t align;
+};
+
+#define SYSTEM_ALIGN ((size_t)16)
+
+static union FluffData system_type_new_aligned(size_t size, size_t align){
+	struct SystemType * type;
 	union FluffData as_data;
 
-	as_data.d_size_t = size;
+	if ((type = malloc(sizeof(struct SystemType)))){
+		type->size = size;
+		type->align = align < sizeof(void *) ? sizeof(void *) : align;
+	}
+	as_data.d_ptr = type;
 	return as_data;
 }
 
+static union FluffData system_type_new(size_t size){
+	return system_type_new_aligned(size, SYSTEM_ALIGN);
+}
+
 static void system_type_free(union FluffData data){
-	// Do nothing
+	free(data.d_ptr);
 }
 
 static void * system_alloc(union FluffData as_data){
-	return malloc(as_data.d_size_t);
+	struct SystemType * type;
+	void * block;
+
+	if (!(type = as_data.d_ptr)){
+		return NULL;
+	}
+	if (type->align <= SYSTEM_ALIGN){
+		return malloc(type->size);
+	}
+	if (posix_memalign(&block, type->align, type->size)){
+		return NULL;
+	}
+	return block;
+}
+
+static size_t system_alloc_batch(
+		union FluffData as_data, size_t n, void ** dest){
+	size_t i;
+
+	for (i = 0; i < n; ++i){
+		if (!(dest[i] = system_alloc(as_data))){
+			break;
+		}
+	}
+	return i;
+}
+
+static void system_free_batch(void ** blocks, size_t n){
+	while (n){
+		free(blocks[--n]);
+	}
 }
 
 const struct FluffMM mm_system = {
@@ -40,27 +92,106 @@ const struct FluffMM mm_system = {
 		&system_alloc,
 		&malloc,
 		&free,
+		&system_alloc_batch,
+		&system_free_batch,
+		&realloc,
+		&system_type_new_aligned,
 };
 
 const struct FluffMM * const fluff_mm_system = &mm_system;
 
 struct CacheBlock {
     struct CacheType * type;
-    struct CacheBlock * next;
+    union {
+        struct CacheBlock * next;
+        /* Allocating thread of a live fluff_mm_cache_threaded block */
+        struct ThreadCache * owner;
+    };
+};
+
+enum CacheKind {
+	CacheKindPlain,
+	CacheKindThreaded,
+	CacheKindCompact,
+	/* Aligned beyond FLUFF_MM_CACHE_LINE, see paged types below */
+	CacheKindPaged,
+};
+
+/*
+ * Statistics counters, only advanced while statistics are enabled
+ */
+struct CacheCounters {
+	unsigned long long allocs;
+	unsigned long long frees;
+	unsigned long long hits;
+	unsigned long long misses;
 };
 
 struct CacheType {
+    enum CacheKind kind;
+    struct CacheCounters counters;
     union FluffData type;
     size_t size;
+    /* From the start of a block to the pointer given out */
+    size_t offset;
     struct CacheBlock * cache;
     size_t count;
+    size_t budget;
+    struct CacheType * prev_type;
+    struct CacheType * next_type;
+    /* Thread-aware cache only */
+    size_t id;
+    /* Thread-aware cache and paged types only */
+    pthread_mutex_t lock;
+    struct Magazine * full;
+    struct Magazine * empty;
+    /* Compact cache and paged types only */
+    char * bump;
+    char * end;
+    struct CacheChunk * chunks;
+};
+
+/*
+ * Run of pages carved into blocks of one compact cache type
+ */
+struct CacheChunk {
+	void * raw;
+	struct CacheChunk * next;
+};
+
+#define MAGAZINE_SIZE 32
+
+/*
+ * Fixed size stack of cached blocks, owned by one thread at a time
+ */
+struct Magazine {
+	struct Magazine * next;
+	size_t rounds;
+	void * round[MAGAZINE_SIZE];
 };
 
 static int prev_mm_need_setup = 1;
 const struct FluffMM * PREV_MM;
 
+static int stats_enabled = 0;
+
+/* Counters may be read by other threads, so never tear a store */
+#define STAT_ADD(c, n) \
+	do { \
+		if (stats_enabled){ \
+			__atomic_store_n(&(c), (c) + (n), __ATOMIC_RELAXED); \
+		} \
+	} while (0)
+#define STAT_INC(c) STAT_ADD(c, 1)
+
+void fluff_mm_cache_stats_enable(int enable){
+	stats_enabled = enable;
+}
+
 static union FluffData type_size;
 static union FluffData block_size;
+static union FluffData magazine_size;
+static union FluffData chunk_size;
 
 static void setup_mm(){
 	if (PREV_MM == NULL){
@@ -68,37 +199,202 @@ static void setup_mm(){
 	}
 	type_size = PREV_MM->f_type_new(sizeof(struct CacheType));
 	block_size = PREV_MM->f_type_new(sizeof(struct CacheBlock));
+	magazine_size = PREV_MM->f_type_new(sizeof(struct Magazine));
+	chunk_size = PREV_MM->f_type_new(sizeof(struct CacheChunk));
 	prev_mm_need_setup = 0;
 }
 
-#define ENSURE_MM if (prev_mm_need_setup) setup_mm();
+/*
+ * PREV_MM is set up when the library is loaded, before the modules create
+ * their types from the caching managers
+ */
+static void __attribute__((constructor(101))) init_mm(){
+	if (prev_mm_need_setup){
+		setup_mm();
+	}
+}
 
 void fuff_mm_cache_setmm(const struct FluffMM * mm){
 	if (!prev_mm_need_setup){
 		PREV_MM->f_type_free(type_size);
 		PREV_MM->f_type_free(block_size);
+		PREV_MM->f_type_free(magazine_size);
+		PREV_MM->f_type_free(chunk_size);
 		prev_mm_need_setup = 1;
 	}
 	PREV_MM = mm;
 	setup_mm();
 }
 
-static union FluffData cache_type_new(size_t size){
+/*
+ * Size classes
+ * Sizes up to the cap given to fluff_mm_cache_set_size_cap are rounded up to
+ * a power of two and cached in a type of that size
+ */
+
+#define SIZE_CLASS_MIN_SHIFT 4
+#define SIZE_CLASS_COUNT 16
+#define SIZE_CLASS_MAX ((size_t)1 << (SIZE_CLASS_MIN_SHIFT + SIZE_CLASS_COUNT - 1))
+
+static size_t size_class_cap = 4096;
+
+/*
+ * Get the index of the class of a size
+ * Return the index, or -1 if the size is above the cap
+ */
+static int size_class(size_t size){
+	if (size > size_class_cap){
+		return -1;
+	}
+	if (size <= ((size_t)1 << SIZE_CLASS_MIN_SHIFT)){
+		return 0;
+	}
+	return sizeof(unsigned long) * CHAR_BIT - __builtin_clzl(size - 1)
+			- SIZE_CLASS_MIN_SHIFT;
+}
+
+#define SIZE_CLASS_SIZE(i) ((size_t)1 << (SIZE_CLASS_MIN_SHIFT + (i)))
+
+void fluff_mm_cache_set_size_cap(size_t cap){
+	size_class_cap = cap < SIZE_CLASS_MAX ? cap : SIZE_CLASS_MAX;
+}
+
+/*
+ * Budgets
+ * Bytes cached by fluff_mm_cache are counted in cache_bytes, and bytes held
+ * in the depots of fluff_mm_cache_threaded in depot_bytes. A free that would
+ * take a type over its budget, or both counts over cache_budget, returns the
+ * block to PREV_MM instead of caching it.
+ */
+
+static size_t cache_budget = (size_t)-1;
+static size_t cache_bytes = 0;
+static size_t depot_bytes = 0;
+
+/* Registry of fluff_mm_cache types, for trimming */
+static struct CacheType * cache_types = NULL;
+
+void fluff_mm_cache_set_budget(size_t bytes){
+	cache_budget = bytes;
+}
+
+void fluff_mm_cache_type_set_budget(union FluffData data, size_t bytes){
+	struct CacheType * type;
+
+	if ((type = data.d_ptr)){
+		type->budget = bytes;
+	}
+}
+
+/*
+ * Get the number of blocks of a type that may still be cached
+ */
+static size_t cache_room(struct CacheType * type){
+	size_t used, room, global;
+
+	used = cache_bytes + __atomic_load_n(&depot_bytes, __ATOMIC_RELAXED);
+	if (type->count * type->size >= type->budget || used >= cache_budget){
+		return 0;
+	}
+	room = (type->budget - type->count * type->size) / type->size;
+	global = (cache_budget - used) / type->size;
+	return room < global ? room : global;
+}
+
+static inline int cache_over_budget(struct CacheType * type, size_t count){
+	return (count * type->size > type->budget
+			|| cache_bytes + __atomic_load_n(&depot_bytes, __ATOMIC_RELAXED)
+				+ type->size > cache_budget);
+}
+
+/*
+ * Create the PREV_MM type holding the blocks of a cache type
+ * An align of 0 takes the alignment of PREV_MM's f_type_new. Others are at
+ * most FLUFF_MM_CACHE_LINE, so the header costs at most that much
+ */
+static void block_type_new(struct CacheType * type, size_t size, size_t align){
+	if (!align){
+		type->offset = sizeof(struct CacheBlock);
+		type->type = PREV_MM->f_type_new(size + type->offset);
+		return;
+	}
+	type->offset = align > sizeof(struct CacheBlock)
+			? align : sizeof(struct CacheBlock);
+	type->type = PREV_MM->f_type_new_aligned(size + type->offset, align);
+}
+
+/*
+ * Set up a block just allocated from PREV_MM
+ * The header is at the start of the block. When the type's offset leaves a
+ * gap, the type is copied just before the pointer given out too, so frees
+ * can find the start of the block
+ */
+static inline void block_init(struct CacheType * type, void * block){
+	((struct CacheBlock *)block)->type = type;
+	((struct CacheBlock *)(block + type->offset) - 1)->type = type;
+}
+
+/*
+ * Get the start of the block holding a pointer given out
+ */
+static inline void * block_start(void * ptr){
+	struct CacheType * type;
+
+	type = ((struct CacheBlock *)ptr - 1)->type;
+	return ptr - (type ? type->offset : sizeof(struct CacheBlock));
+}
+
+/*
+ * Paged types, defined after the compact caching manager
+ */
+
+/* Set once a paged type is made, until then frees skip the page map */
+static int paged_used = 0;
+
+static union FluffData paged_type_new(size_t size, size_t align);
+static void paged_type_free(struct CacheType * type);
+static void * paged_alloc(struct CacheType * type);
+static size_t paged_alloc_batch(
+		struct CacheType * type, size_t n, void ** dest);
+static int paged_free(void * block);
+static struct CacheType * paged_type_of(void * block);
+
+#define PAGED_FREE(block) \
+	(__atomic_load_n(&paged_used, __ATOMIC_RELAXED) && paged_free(block))
+
+static union FluffData cache_type_create(size_t size, size_t align){
     struct CacheType * type;
     union FluffData data;
 
-    ENSURE_MM;
-
+    if (align > FLUFF_MM_CACHE_LINE){
+    	return paged_type_new(size, align);
+    }
     if ((type = PREV_MM->f_alloc(type_size))){
+    	type->kind = CacheKindPlain;
+    	memset(&type->counters, 0, sizeof(struct CacheCounters));
     	type->size = size;
-        type->type = PREV_MM->f_type_new(size + sizeof(struct CacheBlock));
+        block_type_new(type, size, align);
         type->cache = NULL;
         type->count = 0;
+        type->budget = (size_t)-1;
+        type->prev_type = NULL;
+        if ((type->next_type = cache_types)){
+        	cache_types->prev_type = type;
+        }
+        cache_types = type;
     }
     data.d_ptr = type;
     return data;
 }
 
+static union FluffData cache_type_new(size_t size){
+	return cache_type_create(size, 0);
+}
+
+static union FluffData cache_type_new_aligned(size_t size, size_t align){
+	return cache_type_create(size, align);
+}
+
 static void cache_clear(struct CacheType * type, size_t size){
     struct CacheBlock * cache, * tcache;
     size_t count, tsize;
@@ -111,6 +407,7 @@ static void cache_clear(struct CacheType * type, size_t size){
         PREV_MM->f_free(cache);
         count -= 1;
     }
+    cache_bytes -= (type->count - count) * tsize;
     type->count = count;
     type->size = tsize;
     type->cache = tcache;
@@ -120,15 +417,26 @@ static void cache_type_free(union FluffData data){
 	struct CacheType * type;
 
 	type = data.d_ptr;
+	if (type->kind == CacheKindPaged){
+		paged_type_free(type);
+		return;
+	}
     cache_clear(type, 0);
+    if (type->prev_type){
+    	type->prev_type->next_type = type->next_type;
+    } else {
+    	cache_types = type->next_type;
+    }
+    if (type->next_type){
+    	type->next_type->prev_type = type->prev_type;
+    }
+    PREV_MM->f_type_free(type->type);
     PREV_MM->f_free(type);
 }
 
-/*
 static size_t cache_size(struct CacheType * type){
     return type->count * type->size;
 }
-*/
 
 static void * cache_alloc(union FluffData data){
 	struct CacheType * type;
@@ -138,20 +446,30 @@ static void * cache_alloc(union FluffData data){
     if (type == NULL){
     	return NULL;
     }
+    if (type->kind == CacheKindPaged){
+    	return paged_alloc(type);
+    }
     if (type->cache){
         block = type->cache;
         type->cache = type->cache->next;
         type->count -= 1;
+        cache_bytes -= type->size;
+        STAT_INC(type->counters.hits);
     } else {
         if (!(block = PREV_MM->f_alloc(type->type))){
         	return NULL;
         }
-        ((struct CacheBlock *)block)->type = type;
+        block_init(type, block);
+        STAT_INC(type->counters.misses);
     }
-    return block + sizeof(struct CacheBlock);
+    STAT_INC(type->counters.allocs);
+    return block + type->offset;
 }
 
-static void * cache_alloc_size(size_t size){
+/*
+ * Allocate an uncached block of any size
+ */
+static void * header_alloc_size(size_t size){
     void * block;
 
     size += sizeof(struct CacheBlock);
@@ -162,18 +480,174 @@ static void * cache_alloc_size(size_t size){
 	return block + sizeof(struct CacheBlock);
 }
 
+static struct CacheType * cache_classes[SIZE_CLASS_COUNT];
+
+static void * cache_alloc_size(size_t size){
+    union FluffData data;
+    int i;
+
+    if ((i = size_class(size)) >= 0){
+    	if (!cache_classes[i]){
+    		cache_classes[i] = cache_type_new(SIZE_CLASS_SIZE(i)).d_ptr;
+    	}
+    	if (cache_classes[i]){
+    		data.d_ptr = cache_classes[i];
+    		return cache_alloc(data);
+    	}
+    }
+    return header_alloc_size(size);
+}
+
 static void cache_free(void * block){
     struct CacheType * type;
 
-	block -= sizeof(struct CacheBlock);
+	if (PAGED_FREE(block)){
+		return;
+	}
+	block = block_start(block);
 	type = ((struct CacheBlock *)block)->type;
-	if (type == NULL){
+	if (type){
+		STAT_INC(type->counters.frees);
+	}
+	if (type == NULL || cache_over_budget(type, type->count + 1)){
 		PREV_MM->f_free(block);
 	} else {
 		((struct CacheBlock *)block)->next = type->cache;
 		type->cache = block;
 		type->count += 1;
+		cache_bytes += type->size;
+	}
+}
+
+static size_t cache_alloc_batch(union FluffData data, size_t n, void ** dest){
+	struct CacheType * type;
+	struct CacheBlock * block;
+	size_t i, k, got;
+
+	type = data.d_ptr;
+	if (type == NULL){
+		return 0;
+	}
+	if (type->kind == CacheKindPaged){
+		return paged_alloc_batch(type, n, dest);
+	}
+	for (i = 0; i < n && (block = type->cache); ++i){
+		type->cache = block->next;
+		dest[i] = block;
 	}
+	type->count -= i;
+	cache_bytes -= i * type->size;
+	STAT_ADD(type->counters.hits, i);
+	got = i;
+	if (i < n){
+		got += PREV_MM->f_alloc_batch(type->type, n - i, dest + i);
+		for (k = i; k < got; ++k){
+			block_init(type, dest[k]);
+		}
+		STAT_ADD(type->counters.misses, got - i);
+	}
+	STAT_ADD(type->counters.allocs, got);
+	for (i = 0; i < got; ++i){
+		dest[i] += type->offset;
+	}
+	return got;
+}
+
+/*
+ * Resize a cached block
+ * Blocks in a type keep their place while the size still fits, uncached
+ * blocks are resized by PREV_MM
+ */
+static void * cache_realloc_with(void * block, size_t size,
+		void * (*alloc_size)(size_t), void (*free_)(void *)){
+	struct CacheType * type;
+	void * new_block;
+
+	if (block == NULL){
+		return alloc_size(size);
+	}
+	type = ((struct CacheBlock *)(block - sizeof(struct CacheBlock)))->type;
+	if (type == NULL){
+		if (!(new_block = PREV_MM->f_realloc(
+				block - sizeof(struct CacheBlock),
+				size + sizeof(struct CacheBlock)))){
+			return NULL;
+		}
+		return new_block + sizeof(struct CacheBlock);
+	}
+	if (size <= type->size){
+		return block;
+	}
+	if ((new_block = alloc_size(size))){
+		memcpy(new_block, block, type->size);
+		free_(block);
+	}
+	return new_block;
+}
+
+static void * cache_realloc(void * block, size_t size){
+	return cache_realloc_with(block, size, &cache_alloc_size, &cache_free);
+}
+
+#define FREE_BATCH 32
+
+/*
+ * Free blocks, splicing each run of blocks of one type onto its cache
+ */
+static void cache_free_batch(void ** blocks, size_t n){
+	struct CacheType * type;
+	struct CacheBlock * block, * head, * tail;
+	void * spill[FREE_BATCH];
+	size_t i, room, run, freed, n_spill;
+
+	n_spill = 0;
+	i = 0;
+	while (i < n){
+		if (PAGED_FREE(blocks[i])){
+			i += 1;
+			continue;
+		}
+		block = block_start(blocks[i]);
+		type = block->type;
+		room = type ? cache_room(type) : 0;
+		head = tail = NULL;
+		run = freed = 0;
+		while (1){
+			if (run < room){
+				block->next = head;
+				head = block;
+				if (!tail){
+					tail = block;
+				}
+				run += 1;
+			} else {
+				spill[n_spill++] = block;
+				if (n_spill == FREE_BATCH){
+					PREV_MM->f_free_batch(spill, n_spill);
+					n_spill = 0;
+				}
+			}
+			freed += 1;
+			if (++i == n || (__atomic_load_n(&paged_used, __ATOMIC_RELAXED)
+					&& paged_type_of(blocks[i]))){
+				break;
+			}
+			block = block_start(blocks[i]);
+			if (block->type != type){
+				break;
+			}
+		}
+		if (type){
+			STAT_ADD(type->counters.frees, freed);
+		}
+		if (run){
+			tail->next = type->cache;
+			type->cache = head;
+			type->count += run;
+			cache_bytes += run * type->size;
+		}
+	}
+	PREV_MM->f_free_batch(spill, n_spill);
 }
 
 const struct FluffMM mm_cache = {
@@ -182,8 +656,1418 @@ const struct FluffMM mm_cache = {
 		&cache_alloc,
 		&cache_alloc_size,
 		&cache_free,
+		&cache_alloc_batch,
+		&cache_free_batch,
+		&cache_realloc,
+		&cache_type_new_aligned,
 };
 
 const struct FluffMM * const fluff_mm_cache = &mm_cache;
 
+/*
+ * Thread-aware caching manager
+ *
+ * Each thread keeps a loaded and a previous magazine per type, so alloc and
+ * free only touch thread local memory. When both are exhausted (or full) a
+ * whole magazine is exchanged with the type's depot under the type's lock.
+ * threaded_lock is only taken to create and free types, to hand out thread
+ * caches and to gather statistics, never by alloc and free once a thread
+ * has its cache.
+ *
+ * A thread's magazines are kept in chunks of MAGS_CHUNK types, found from a
+ * fixed array of chunk pointers by the type's id. Chunks are added as the
+ * thread meets types with higher ids and never move, so other threads may
+ * read them without a lock. Types past the last chunk are not cached.
+ */
+
+#define MAGS_CHUNK_SHIFT 6
+#define MAGS_CHUNK ((size_t)1 << MAGS_CHUNK_SHIFT)
+#define MAGS_CHUNKS 64
+
+struct ThreadMagazines {
+	struct Magazine * loaded;
+	struct Magazine * previous;
+	struct CacheCounters counters;
+	/*
+	 * Blocks of the type allocated through this cache and freed by other
+	 * threads, pushed lock-free. REMOTE_CLOSED while the cache is parked
+	 */
+	struct CacheBlock * remote;
+};
+
+#define REMOTE_CLOSED ((struct CacheBlock *)1)
+
+struct ThreadCache {
+	struct ThreadCache * next;
+	struct ThreadCache * all_next;
+	struct ThreadMagazines * mags[MAGS_CHUNKS];
+};
+
+static pthread_mutex_t threaded_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t threaded_once = PTHREAD_ONCE_INIT;
+static pthread_key_t threaded_key;
+
+/* Types indexed by id, NULL once freed. Protected by threaded_lock */
+static struct CacheType ** threaded_types = NULL;
+static size_t threaded_types_count = 0;
+static size_t threaded_types_size = 0;
+
+/* Caches left behind by exited threads, reused by new threads */
+static struct ThreadCache * threaded_spare = NULL;
+
+/* Every cache ever created, for statistics. Protected by threaded_lock */
+static struct ThreadCache * threaded_all = NULL;
+
+static __thread struct ThreadCache * thread_cache = NULL;
+
+/*
+ * Get the magazines of a thread cache for a type id
+ * Return NULL if the cache has no chunk for the id yet
+ */
+static inline struct ThreadMagazines * thread_cache_mags(
+		struct ThreadCache * tc, size_t id){
+	struct ThreadMagazines * chunk;
+
+	if ((id >> MAGS_CHUNK_SHIFT) >= MAGS_CHUNKS || !(chunk = __atomic_load_n(
+			tc->mags + (id >> MAGS_CHUNK_SHIFT), __ATOMIC_ACQUIRE))){
+		return NULL;
+	}
+	return chunk + (id & (MAGS_CHUNK - 1));
+}
+
+static void magazine_drain(struct Magazine * mag){
+	while (mag->rounds){
+		PREV_MM->f_free(mag->round[--mag->rounds]);
+	}
+}
+
+/*
+ * Check if adding rounds blocks to a type's depot would exceed a budget
+ * The type's lock must be held
+ */
+static inline int depot_over_budget(struct CacheType * type, size_t rounds){
+	return ((type->count + rounds) * type->size > type->budget
+			|| cache_bytes + __atomic_load_n(&depot_bytes, __ATOMIC_RELAXED)
+				+ rounds * type->size > cache_budget);
+}
+
+static void depot_put(struct CacheType * type, struct Magazine * mag){
+	if (mag->rounds && depot_over_budget(type, mag->rounds)){
+		magazine_drain(mag);
+	}
+	if (mag->rounds){
+		type->count += mag->rounds;
+		__atomic_add_fetch(&depot_bytes, mag->rounds * type->size,
+				__ATOMIC_RELAXED);
+		mag->next = type->full;
+		__atomic_store_n(&type->full, mag, __ATOMIC_RELAXED);
+	} else {
+		mag->next = type->empty;
+		type->empty = mag;
+	}
+}
+
+/*
+ * Hand a block to the thread cache that allocated it
+ * The owner's thread has exited if its queue is closed, and the block goes
+ * back to PREV_MM rather than waiting for a thread to take the cache over
+ */
+static void remote_push(struct ThreadCache * owner,
+		struct CacheType * type, struct CacheBlock * block){
+	struct ThreadMagazines * mags;
+	struct CacheBlock * head;
+
+	/* owner allocated the block, so it has magazines for the type */
+	mags = thread_cache_mags(owner, type->id);
+	head = __atomic_load_n(&mags->remote, __ATOMIC_RELAXED);
+	do {
+		if (head == REMOTE_CLOSED){
+			PREV_MM->f_free(block);
+			return;
+		}
+		block->next = head;
+	} while (!__atomic_compare_exchange_n(&mags->remote, &head, block,
+			1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static struct Magazine * magazine_for_free(
+		struct CacheType *, struct ThreadMagazines *);
+
+/*
+ * Put a list of blocks of a type into the magazines of a thread cache
+ */
+static void remote_put(struct CacheType * type,
+		struct ThreadMagazines * mags, struct CacheBlock * block){
+	struct CacheBlock * next;
+	struct Magazine * mag;
+
+	for (; block; block = next){
+		next = block->next;
+		if ((mag = magazine_for_free(type, mags))){
+			mag->round[mag->rounds++] = block;
+		} else {
+			PREV_MM->f_free(block);
+		}
+	}
+}
+
+/*
+ * Move the blocks of a type other threads freed back to the calling thread
+ * into its magazines
+ * Only the owning thread drains its queue of a type, and only while
+ * allocating the type, so the type cannot be freed under it
+ */
+static void remote_drain(
+		struct CacheType * type, struct ThreadMagazines * mags){
+	if (!__atomic_load_n(&mags->remote, __ATOMIC_RELAXED)){
+		return;
+	}
+	remote_put(type, mags,
+			__atomic_exchange_n(&mags->remote, NULL, __ATOMIC_ACQUIRE));
+}
+
+static void thread_cache_release(void * data){
+	struct ThreadCache * tc;
+	struct ThreadMagazines * mags;
+	struct CacheType * type;
+	struct CacheBlock * block, * next;
+	size_t i;
+
+	tc = data;
+	pthread_mutex_lock(&threaded_lock);
+	for (i = 0; i < threaded_types_count; ++i){
+		if (!(mags = thread_cache_mags(tc, i))){
+			continue;
+		}
+		type = threaded_types[i];
+		block = __atomic_exchange_n(
+				&mags->remote, REMOTE_CLOSED, __ATOMIC_ACQUIRE);
+		if (type){
+			remote_put(type, mags, block);
+		} else {
+			for (; block; block = next){
+				next = block->next;
+				PREV_MM->f_free(block);
+			}
+		}
+		if (!(mags->loaded || mags->previous)){
+			continue;
+		}
+		if (type){
+			pthread_mutex_lock(&type->lock);
+			if (mags->loaded){
+				depot_put(type, mags->loaded);
+			}
+			if (mags->previous){
+				depot_put(type, mags->previous);
+			}
+			pthread_mutex_unlock(&type->lock);
+		} else {
+			if (mags->loaded){
+				magazine_drain(mags->loaded);
+				PREV_MM->f_free(mags->loaded);
+			}
+			if (mags->previous){
+				magazine_drain(mags->previous);
+				PREV_MM->f_free(mags->previous);
+			}
+		}
+		mags->loaded = mags->previous = NULL;
+	}
+	tc->next = threaded_spare;
+	threaded_spare = tc;
+	pthread_mutex_unlock(&threaded_lock);
+	thread_cache = NULL;
+}
+
+static void threaded_key_create(){
+	pthread_key_create(&threaded_key, &thread_cache_release);
+}
+
+/*
+ * Get the calling thread's magazines for a type
+ * Return NULL on failure
+ */
+static struct ThreadMagazines * thread_magazines(struct CacheType * type){
+	struct ThreadCache * tc;
+	struct ThreadMagazines * chunk;
+	size_t index, i;
+
+	if ((tc = thread_cache) && (chunk = thread_cache_mags(tc, type->id))){
+		return chunk;
+	}
+	if (!tc){
+		pthread_once(&threaded_once, &threaded_key_create);
+		pthread_mutex_lock(&threaded_lock);
+		if ((tc = threaded_spare)){
+			threaded_spare = tc->next;
+		}
+		pthread_mutex_unlock(&threaded_lock);
+		if (!tc){
+			if (!(tc = PREV_MM->f_alloc_size(sizeof(struct ThreadCache)))){
+				return NULL;
+			}
+			memset(tc->mags, 0, sizeof(tc->mags));
+			pthread_mutex_lock(&threaded_lock);
+			tc->all_next = threaded_all;
+			threaded_all = tc;
+			pthread_mutex_unlock(&threaded_lock);
+		} else {
+			/* Reopen the queues closed when the cache was parked */
+			for (index = 0; index < MAGS_CHUNKS; ++index){
+				for (i = 0; tc->mags[index] && i < MAGS_CHUNK; ++i){
+					__atomic_store_n(&tc->mags[index][i].remote, NULL,
+							__ATOMIC_RELAXED);
+				}
+			}
+		}
+		tc->next = NULL;
+		thread_cache = tc;
+		pthread_setspecific(threaded_key, tc);
+	}
+	if ((index = type->id >> MAGS_CHUNK_SHIFT) >= MAGS_CHUNKS){
+		return NULL;
+	}
+	if (!tc->mags[index]){
+		if (!(chunk = PREV_MM->f_alloc_size(
+				MAGS_CHUNK * sizeof(struct ThreadMagazines)))){
+			return NULL;
+		}
+		memset(chunk, 0, MAGS_CHUNK * sizeof(struct ThreadMagazines));
+		/* Published for threads reading statistics */
+		__atomic_store_n(tc->mags + index, chunk, __ATOMIC_RELEASE);
+	}
+	return thread_cache_mags(tc, type->id);
+}
+
+static union FluffData threaded_type_create(size_t size, size_t align){
+	struct CacheType * type, ** types;
+	union FluffData data;
+	size_t types_size;
+
+	if (align > FLUFF_MM_CACHE_LINE){
+		return paged_type_new(size, align);
+	}
+	data.d_ptr = NULL;
+	pthread_mutex_lock(&threaded_lock);
+	if (threaded_types_count == threaded_types_size){
+		types_size = threaded_types_size ? threaded_types_size * 2 : 16;
+		if (!(types = PREV_MM->f_alloc_size(
+				types_size * sizeof(struct CacheType *)))){
+			pthread_mutex_unlock(&threaded_lock);
+			return data;
+		}
+		if (threaded_types){
+			memcpy(types, threaded_types,
+					threaded_types_count * sizeof(struct CacheType *));
+			PREV_MM->f_free(threaded_types);
+		}
+		threaded_types = types;
+		threaded_types_size = types_size;
+	}
+	if ((type = PREV_MM->f_alloc(type_size))){
+		type->kind = CacheKindThreaded;
+		memset(&type->counters, 0, sizeof(struct CacheCounters));
+		type->size = size;
+		block_type_new(type, size, align);
+		type->cache = NULL;
+		type->count = 0;
+		type->budget = (size_t)-1;
+		type->id = threaded_types_count;
+		type->full = type->empty = NULL;
+		pthread_mutex_init(&type->lock, NULL);
+		threaded_types[threaded_types_count++] = type;
+	}
+	pthread_mutex_unlock(&threaded_lock);
+	data.d_ptr = type;
+	return data;
+}
+
+static union FluffData threaded_type_new(size_t size){
+	return threaded_type_create(size, 0);
+}
+
+static union FluffData threaded_type_new_aligned(size_t size, size_t align){
+	return threaded_type_create(size, align);
+}
+
+/*
+ * Free a type of the thread-aware cache
+ * Blocks still held by other threads' magazines are released when those
+ * threads exit
+ */
+static void threaded_type_free(union FluffData data){
+	struct CacheType * type;
+	struct ThreadMagazines * mags;
+	struct ThreadCache * tc;
+	struct CacheBlock * block, * next;
+	struct Magazine * mag, * lists[4];
+	int i;
+
+	type = data.d_ptr;
+	if (type->kind == CacheKindPaged){
+		paged_type_free(type);
+		return;
+	}
+	pthread_mutex_lock(&threaded_lock);
+	threaded_types[type->id] = NULL;
+	/* Empty every queue of the type, leaving closed ones closed */
+	for (tc = threaded_all; tc; tc = tc->all_next){
+		if (!(mags = thread_cache_mags(tc, type->id))){
+			continue;
+		}
+		block = __atomic_load_n(&mags->remote, __ATOMIC_ACQUIRE);
+		while (block && block != REMOTE_CLOSED
+				&& !__atomic_compare_exchange_n(&mags->remote, &block, NULL,
+						1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+		for (; block && block != REMOTE_CLOSED; block = next){
+			next = block->next;
+			PREV_MM->f_free(block);
+		}
+	}
+	pthread_mutex_unlock(&threaded_lock);
+	__atomic_sub_fetch(&depot_bytes, type->count * type->size,
+			__ATOMIC_RELAXED);
+	lists[0] = type->full;
+	lists[1] = type->empty;
+	lists[2] = lists[3] = NULL;
+	if (thread_cache && (mags = thread_cache_mags(thread_cache, type->id))){
+		lists[2] = mags->loaded;
+		lists[3] = mags->previous;
+		mags->loaded = mags->previous = NULL;
+	}
+	for (i = 0; i < 4; ++i){
+		while ((mag = lists[i])){
+			lists[i] = (i < 2) ? mag->next : NULL;
+			magazine_drain(mag);
+			PREV_MM->f_free(mag);
+		}
+	}
+	pthread_mutex_destroy(&type->lock);
+	PREV_MM->f_type_free(type->type);
+	PREV_MM->f_free(type);
+}
+
+/*
+ * Make sure the loaded magazine has a round to allocate
+ * Return the loaded magazine, or NULL if no cached block is available
+ */
+static struct Magazine * magazine_for_alloc(
+		struct CacheType * type, struct ThreadMagazines * mags){
+	struct Magazine * mag;
+
+	if ((mag = mags->loaded) && mag->rounds){
+		return mag;
+	}
+	if ((mag = mags->previous) && mag->rounds){
+		mags->previous = mags->loaded;
+		mags->loaded = mag;
+		return mag;
+	}
+	remote_drain(type, mags);
+	if ((mag = mags->loaded) && mag->rounds){
+		return mag;
+	}
+	if (!__atomic_load_n(&type->full, __ATOMIC_RELAXED)){
+		return NULL;
+	}
+	pthread_mutex_lock(&type->lock);
+	if ((mag = type->full)){
+		__atomic_store_n(&type->full, mag->next, __ATOMIC_RELAXED);
+		type->count -= mag->rounds;
+		__atomic_sub_fetch(&depot_bytes, mag->rounds * type->size,
+				__ATOMIC_RELAXED);
+		if (mags->previous){
+			mags->previous->next = type->empty;
+			type->empty = mags->previous;
+		}
+		mags->previous = mags->loaded;
+		mags->loaded = mag;
+	}
+	pthread_mutex_unlock(&type->lock);
+	return mag;
+}
+
+/*
+ * Make sure the loaded magazine has room for a round
+ * Return the loaded magazine, or NULL if no magazine could be had
+ */
+static struct Magazine * magazine_for_free(
+		struct CacheType * type, struct ThreadMagazines * mags){
+	struct Magazine * mag, * spill;
+
+	if ((mag = mags->loaded) && mag->rounds < MAGAZINE_SIZE){
+		return mag;
+	}
+	if ((mag = mags->previous) && mag->rounds < MAGAZINE_SIZE){
+		mags->previous = mags->loaded;
+		mags->loaded = mag;
+		return mag;
+	}
+	spill = mag = NULL;
+	pthread_mutex_lock(&type->lock);
+	if (mags->previous){
+		if (depot_over_budget(type, mags->previous->rounds)){
+			spill = mags->previous;
+		} else {
+			depot_put(type, mags->previous);
+		}
+	}
+	mags->previous = mags->loaded;
+	if (!spill && (mag = type->empty)){
+		type->empty = mag->next;
+	}
+	pthread_mutex_unlock(&type->lock);
+	if (spill){
+		magazine_drain(spill);
+		mag = spill;
+	} else if (!mag && (mag = PREV_MM->f_alloc(magazine_size))){
+		mag->rounds = 0;
+	}
+	mags->loaded = mag;
+	return mag;
+}
+
+static void * threaded_alloc(union FluffData data){
+	struct CacheType * type;
+	struct ThreadMagazines * mags;
+	struct Magazine * mag;
+	void * block;
+
+	type = data.d_ptr;
+	if (type == NULL){
+		return NULL;
+	}
+	if (type->kind == CacheKindPaged){
+		return paged_alloc(type);
+	}
+	if ((mags = thread_magazines(type))
+			&& (mag = magazine_for_alloc(type, mags))){
+		block = mag->round[--mag->rounds];
+		((struct CacheBlock *)block)->owner = thread_cache;
+		STAT_INC(mags->counters.allocs);
+		STAT_INC(mags->counters.hits);
+		return block + type->offset;
+	}
+	if (!(block = PREV_MM->f_alloc(type->type))){
+		return NULL;
+	}
+	block_init(type, block);
+	/* Without magazines no queue can take the block back */
+	((struct CacheBlock *)block)->owner = mags ? thread_cache : NULL;
+	if (mags){
+		STAT_INC(mags->counters.allocs);
+		STAT_INC(mags->counters.misses);
+	}
+	return block + type->offset;
+}
+
+static size_t threaded_alloc_batch(
+		union FluffData data, size_t n, void ** dest){
+	struct CacheType * type;
+	struct ThreadMagazines * mags;
+	struct Magazine * mag;
+	size_t i, k, got;
+
+	type = data.d_ptr;
+	if (type == NULL){
+		return 0;
+	}
+	if (type->kind == CacheKindPaged){
+		return paged_alloc_batch(type, n, dest);
+	}
+	i = 0;
+	if ((mags = thread_magazines(type))){
+		while (i < n && (mag = magazine_for_alloc(type, mags))){
+			k = mag->rounds < n - i ? mag->rounds : n - i;
+			mag->rounds -= k;
+			memcpy(dest + i, mag->round + mag->rounds, k * sizeof(void *));
+			i += k;
+		}
+		STAT_ADD(mags->counters.hits, i);
+	}
+	got = i;
+	if (i < n){
+		got += PREV_MM->f_alloc_batch(type->type, n - i, dest + i);
+		for (k = i; k < got; ++k){
+			block_init(type, dest[k]);
+		}
+		if (mags){
+			STAT_ADD(mags->counters.misses, got - i);
+		}
+	}
+	if (mags){
+		STAT_ADD(mags->counters.allocs, got);
+	}
+	for (k = 0; k < got; ++k){
+		((struct CacheBlock *)dest[k])->owner = mags ? thread_cache : NULL;
+		dest[k] += type->offset;
+	}
+	return got;
+}
+
+static void threaded_free(void * block){
+	struct CacheType * type;
+	struct ThreadMagazines * mags;
+	struct ThreadCache * owner;
+	struct Magazine * mag;
+
+	if (PAGED_FREE(block)){
+		return;
+	}
+	block = block_start(block);
+	type = ((struct CacheBlock *)block)->type;
+	if (type == NULL || !(mags = thread_magazines(type))){
+		PREV_MM->f_free(block);
+		return;
+	}
+	STAT_INC(mags->counters.frees);
+	owner = ((struct CacheBlock *)block)->owner;
+	if (owner && owner != thread_cache){
+		remote_push(owner, type, block);
+		return;
+	}
+	if (!(mag = magazine_for_free(type, mags))){
+		PREV_MM->f_free(block);
+		return;
+	}
+	mag->round[mag->rounds++] = block;
+}
+
+static void threaded_free_batch(void ** blocks, size_t n){
+	struct CacheType * type, * last;
+	struct ThreadMagazines * mags;
+	struct ThreadCache * owner;
+	struct Magazine * mag;
+	void * block;
+	size_t i;
+
+	last = NULL;
+	mags = NULL;
+	for (i = 0; i < n; ++i){
+		if (PAGED_FREE(blocks[i])){
+			continue;
+		}
+		block = block_start(blocks[i]);
+		type = ((struct CacheBlock *)block)->type;
+		if (type != last){
+			mags = type ? thread_magazines(type) : NULL;
+			last = type;
+		}
+		if (!mags){
+			PREV_MM->f_free(block);
+			continue;
+		}
+		STAT_INC(mags->counters.frees);
+		owner = ((struct CacheBlock *)block)->owner;
+		if (owner && owner != thread_cache){
+			remote_push(owner, type, block);
+			continue;
+		}
+		if (!(mag = magazine_for_free(type, mags))){
+			PREV_MM->f_free(block);
+			continue;
+		}
+		mag->round[mag->rounds++] = block;
+	}
+}
+
+static struct CacheType * threaded_classes[SIZE_CLASS_COUNT];
+
+static void * threaded_alloc_size(size_t size){
+	struct CacheType * type, * expected;
+	union FluffData data;
+	int i;
+
+	if ((i = size_class(size)) >= 0){
+		type = __atomic_load_n(threaded_classes + i, __ATOMIC_ACQUIRE);
+		if (!type && (type = threaded_type_new(SIZE_CLASS_SIZE(i)).d_ptr)){
+			expected = NULL;
+			if (!__atomic_compare_exchange_n(threaded_classes + i, &expected,
+					type, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+				data.d_ptr = type;
+				threaded_type_free(data);
+				type = expected;
+			}
+		}
+		if (type){
+			data.d_ptr = type;
+			return threaded_alloc(data);
+		}
+	}
+	return header_alloc_size(size);
+}
+
+static void * threaded_realloc(void * block, size_t size){
+	return cache_realloc_with(
+			block, size, &threaded_alloc_size, &threaded_free);
+}
+
+const struct FluffMM mm_cache_threaded = {
+		&threaded_type_new,
+		&threaded_type_free,
+		&threaded_alloc,
+		&threaded_alloc_size,
+		&threaded_free,
+		&threaded_alloc_batch,
+		&threaded_free_batch,
+		&threaded_realloc,
+		&threaded_type_new_aligned,
+};
+
+const struct FluffMM * const fluff_mm_cache_threaded = &mm_cache_threaded;
+
+/*
+ * Return whole magazines from a type's depot until it holds at most size
+ * bytes
+ */
+static void depot_clear(struct CacheType * type, size_t size){
+	struct Magazine * mag, * drained;
+
+	drained = NULL;
+	pthread_mutex_lock(&type->lock);
+	while (type->count * type->size > size && (mag = type->full)){
+		__atomic_store_n(&type->full, mag->next, __ATOMIC_RELAXED);
+		type->count -= mag->rounds;
+		__atomic_sub_fetch(&depot_bytes, mag->rounds * type->size,
+				__ATOMIC_RELAXED);
+		mag->next = drained;
+		drained = mag;
+	}
+	pthread_mutex_unlock(&type->lock);
+	while ((mag = drained)){
+		drained = mag->next;
+		magazine_drain(mag);
+		PREV_MM->f_free(mag);
+	}
+}
+
+size_t fluff_mm_cache_trim(size_t bytes){
+	struct CacheType * type;
+	size_t total, i;
+	double ratio;
+
+	total = cache_bytes + __atomic_load_n(&depot_bytes, __ATOMIC_RELAXED);
+	if (total <= bytes){
+		return total;
+	}
+	/* Every type gives up the same fraction of what it holds */
+	ratio = (double)bytes / total;
+	for (type = cache_types; type; type = type->next_type){
+		cache_clear(type, cache_size(type) * ratio);
+	}
+	pthread_mutex_lock(&threaded_lock);
+	for (i = 0; i < threaded_types_count; ++i){
+		if ((type = threaded_types[i])){
+			depot_clear(type, type->count * type->size * ratio);
+		}
+	}
+	pthread_mutex_unlock(&threaded_lock);
+	return cache_bytes + __atomic_load_n(&depot_bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * Compact caching manager
+ *
+ * Blocks of a type are carved from page aligned chunks and carry no header.
+ * Every page of a chunk is recorded in a page map, so f_free finds the type
+ * from the block's address. Blocks from f_alloc_size are never in a mapped
+ * page and keep the usual header.
+ */
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE ((size_t)1 << PAGE_SHIFT)
+#define PAGEMAP_BITS 12
+#define PAGEMAP_SIZE ((size_t)1 << PAGEMAP_BITS)
+#define PAGEMAP_MASK (PAGEMAP_SIZE - 1)
+#define CHUNK_BYTES (16 * PAGE_SIZE)
+#define CHUNK_MIN_BLOCKS 16
+
+/* Registry of fluff_mm_cache_compact types, for statistics */
+static struct CacheType * compact_types = NULL;
+
+/*
+ * Three levels of PAGEMAP_BITS each cover 48 bit addresses
+ * Paged types grow from any thread, so nodes are added under pagemap_lock
+ * and published atomically for lookups, which take no lock
+ */
+static struct CacheType ** * pagemap[PAGEMAP_SIZE];
+static pthread_mutex_t pagemap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct CacheType * pagemap_get(void * addr){
+	uintptr_t page;
+	struct CacheType ** * mid, ** leaf;
+
+	page = (uintptr_t)addr >> PAGE_SHIFT;
+	if (!(mid = __atomic_load_n(
+			pagemap + ((page >> (2 * PAGEMAP_BITS)) & PAGEMAP_MASK),
+			__ATOMIC_ACQUIRE))){
+		return NULL;
+	}
+	if (!(leaf = __atomic_load_n(
+			mid + ((page >> PAGEMAP_BITS) & PAGEMAP_MASK),
+			__ATOMIC_ACQUIRE))){
+		return NULL;
+	}
+	return __atomic_load_n(leaf + (page & PAGEMAP_MASK), __ATOMIC_RELAXED);
+}
+
+static void * pagemap_node_new(){
+	void * node;
+
+	if ((node = PREV_MM->f_alloc_size(PAGEMAP_SIZE * sizeof(void *)))){
+		memset(node, 0, PAGEMAP_SIZE * sizeof(void *));
+	}
+	return node;
+}
+
+/*
+ * Record type as the owner of every page in [start, start + length)
+ * Return 0 on success, -1 on failure
+ */
+static int pagemap_set(char * start, size_t length, struct CacheType * type){
+	uintptr_t page, last;
+	struct CacheType ** * * mid, ** * leaf;
+	void * node;
+	int result = 0;
+
+	last = ((uintptr_t)start + length - 1) >> PAGE_SHIFT;
+	pthread_mutex_lock(&pagemap_lock);
+	for (page = (uintptr_t)start >> PAGE_SHIFT; page <= last; ++page){
+		mid = pagemap + ((page >> (2 * PAGEMAP_BITS)) & PAGEMAP_MASK);
+		if (!*mid){
+			if (!(node = pagemap_node_new())){
+				result = -1;
+				break;
+			}
+			__atomic_store_n(mid, node, __ATOMIC_RELEASE);
+		}
+		leaf = *mid + ((page >> PAGEMAP_BITS) & PAGEMAP_MASK);
+		if (!*leaf){
+			if (!(node = pagemap_node_new())){
+				result = -1;
+				break;
+			}
+			__atomic_store_n(leaf, node, __ATOMIC_RELEASE);
+		}
+		__atomic_store_n(*leaf + (page & PAGEMAP_MASK), type,
+				__ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&pagemap_lock);
+	return result;
+}
+
+static size_t compact_chunk_bytes(struct CacheType * type){
+	size_t bytes;
+
+	bytes = type->size * CHUNK_MIN_BLOCKS;
+	if (bytes < CHUNK_BYTES){
+		return CHUNK_BYTES;
+	}
+	return (bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+static int compact_grow(struct CacheType * type){
+	struct CacheChunk * chunk;
+	size_t bytes;
+	char * start;
+
+	bytes = compact_chunk_bytes(type);
+	if (!(chunk = PREV_MM->f_alloc(chunk_size))){
+		return -1;
+	}
+	if (!(chunk->raw = PREV_MM->f_alloc_size(bytes + PAGE_SIZE - 1))){
+		PREV_MM->f_free(chunk);
+		return -1;
+	}
+	start = (char *)(((uintptr_t)chunk->raw + PAGE_SIZE - 1)
+			& ~(uintptr_t)(PAGE_SIZE - 1));
+	if (pagemap_set(start, bytes, type)){
+		pagemap_set(start, bytes, NULL);
+		PREV_MM->f_free(chunk->raw);
+		PREV_MM->f_free(chunk);
+		return -1;
+	}
+	chunk->next = type->chunks;
+	type->chunks = chunk;
+	type->bump = start;
+	type->end = start + bytes;
+	return 0;
+}
+
+/*
+ * Allocate a type carved from chunks, not yet in any registry
+ * Chunks start on a page, so blocks whose size is a multiple of an alignment
+ * up to the page size stay aligned
+ */
+static struct CacheType * chunked_type_new(
+		enum CacheKind kind, size_t size, size_t align){
+	struct CacheType * type;
+
+	if (align < sizeof(void *)){
+		align = sizeof(void *);
+	}
+	if ((type = PREV_MM->f_alloc(type_size))){
+		if (size < sizeof(void *)){
+			size = sizeof(void *);
+		}
+		type->kind = kind;
+		memset(&type->counters, 0, sizeof(struct CacheCounters));
+		type->size = (size + align - 1) & ~(align - 1);
+		type->offset = 0;
+		type->type = fluff_data_zero;
+		type->cache = NULL;
+		type->count = 0;
+		/* Not enforced, see fluff_mm_cache_compact in mm.h */
+		type->budget = (size_t)-1;
+		type->bump = type->end = NULL;
+		type->chunks = NULL;
+		type->prev_type = NULL;
+	}
+	return type;
+}
+
+/*
+ * Return the chunks of a type carved from chunks
+ */
+static void chunked_type_clear(struct CacheType * type){
+	struct CacheChunk * chunk;
+	char * start;
+	size_t bytes;
+
+	bytes = compact_chunk_bytes(type);
+	while ((chunk = type->chunks)){
+		type->chunks = chunk->next;
+		start = (char *)(((uintptr_t)chunk->raw + PAGE_SIZE - 1)
+				& ~(uintptr_t)(PAGE_SIZE - 1));
+		pagemap_set(start, bytes, NULL);
+		PREV_MM->f_free(chunk->raw);
+		PREV_MM->f_free(chunk);
+	}
+}
+
+static union FluffData compact_type_create(size_t size, size_t align){
+	struct CacheType * type;
+	union FluffData data;
+
+	if ((type = chunked_type_new(CacheKindCompact, size, align))){
+		if ((type->next_type = compact_types)){
+			compact_types->prev_type = type;
+		}
+		compact_types = type;
+	}
+	data.d_ptr = type;
+	return data;
+}
+
+static union FluffData compact_type_new(size_t size){
+	return compact_type_create(size, sizeof(void *));
+}
+
+static union FluffData compact_type_new_aligned(size_t size, size_t align){
+	return compact_type_create(size, align);
+}
+
+/*
+ * Chunks are returned with the type, every block of the type should be
+ * freed first
+ */
+static void compact_type_free(union FluffData data){
+	struct CacheType * type;
+
+	type = data.d_ptr;
+	chunked_type_clear(type);
+	if (type->prev_type){
+		type->prev_type->next_type = type->next_type;
+	} else {
+		compact_types = type->next_type;
+	}
+	if (type->next_type){
+		type->next_type->prev_type = type->prev_type;
+	}
+	PREV_MM->f_free(type);
+}
+
+static void * compact_alloc(union FluffData data){
+	struct CacheType * type;
+	void * block;
+
+	type = data.d_ptr;
+	if (type == NULL){
+		return NULL;
+	}
+	if ((block = type->cache)){
+		type->cache = *(void **)block;
+		type->count -= 1;
+		STAT_INC(type->counters.allocs);
+		STAT_INC(type->counters.hits);
+		return block;
+	}
+	if (type->bump + type->size > type->end && compact_grow(type)){
+		return NULL;
+	}
+	block = type->bump;
+	type->bump += type->size;
+	STAT_INC(type->counters.allocs);
+	STAT_INC(type->counters.misses);
+	return block;
+}
+
+static void compact_free(void * block){
+	struct CacheType * type;
+
+	if ((type = pagemap_get(block))){
+		*(void **)block = type->cache;
+		type->cache = block;
+		type->count += 1;
+		STAT_INC(type->counters.frees);
+	} else {
+		cache_free(block);
+	}
+}
+
+static size_t compact_alloc_batch(
+		union FluffData data, size_t n, void ** dest){
+	struct CacheType * type;
+	size_t i, k;
+	void * block;
+
+	type = data.d_ptr;
+	if (type == NULL){
+		return 0;
+	}
+	for (i = 0; i < n && (block = type->cache); ++i){
+		type->cache = *(void **)block;
+		dest[i] = block;
+	}
+	type->count -= i;
+	STAT_ADD(type->counters.hits, i);
+	k = i;
+	while (i < n){
+		if (type->bump + type->size > type->end && compact_grow(type)){
+			break;
+		}
+		while (i < n && type->bump + type->size <= type->end){
+			dest[i++] = type->bump;
+			type->bump += type->size;
+		}
+	}
+	STAT_ADD(type->counters.misses, i - k);
+	STAT_ADD(type->counters.allocs, i);
+	return i;
+}
+
+/*
+ * Free blocks, splicing each run of blocks of one type onto its cache
+ */
+static void compact_free_batch(void ** blocks, size_t n){
+	struct CacheType * type;
+	uintptr_t page, last_page;
+	void * head, * tail;
+	size_t i, run;
+
+	type = NULL;
+	page = last_page = 0;
+	head = tail = NULL;
+	run = 0;
+	for (i = 0; i <= n; ++i){
+		if (i < n && (page = (uintptr_t)blocks[i] >> PAGE_SHIFT) == last_page
+				&& type){
+			*(void **)blocks[i] = head;
+			head = blocks[i];
+			run += 1;
+			continue;
+		}
+		if (run){
+			*(void **)tail = type->cache;
+			type->cache = head;
+			type->count += run;
+			STAT_ADD(type->counters.frees, run);
+		}
+		if (i == n){
+			break;
+		}
+		last_page = page;
+		if ((type = pagemap_get(blocks[i]))){
+			*(void **)blocks[i] = NULL;
+			head = tail = blocks[i];
+			run = 1;
+		} else {
+			cache_free(blocks[i]);
+			run = 0;
+		}
+	}
+}
+
+static struct CacheType * compact_classes[SIZE_CLASS_COUNT];
+
+static void * compact_alloc_size(size_t size){
+	union FluffData data;
+	int i;
+
+	if ((i = size_class(size)) >= 0){
+		if (!compact_classes[i]){
+			compact_classes[i] = compact_type_new(SIZE_CLASS_SIZE(i)).d_ptr;
+		}
+		if (compact_classes[i]){
+			data.d_ptr = compact_classes[i];
+			return compact_alloc(data);
+		}
+	}
+	return header_alloc_size(size);
+}
+
+static void * compact_realloc(void * block, size_t size){
+	struct CacheType * type;
+	void * new_block;
+
+	if (!(type = pagemap_get(block))){
+		return cache_realloc_with(
+				block, size, &compact_alloc_size, &compact_free);
+	}
+	if (size <= type->size){
+		return block;
+	}
+	if ((new_block = compact_alloc_size(size))){
+		memcpy(new_block, block, type->size);
+		compact_free(block);
+	}
+	return new_block;
+}
+
+const struct FluffMM mm_cache_compact = {
+		&compact_type_new,
+		&compact_type_free,
+		&compact_alloc,
+		&compact_alloc_size,
+		&compact_free,
+		&compact_alloc_batch,
+		&compact_free_batch,
+		&compact_realloc,
+		&compact_type_new_aligned,
+};
+
+const struct FluffMM * const fluff_mm_cache_compact = &mm_cache_compact;
+
+/*
+ * Paged types
+ *
+ * fluff_mm_cache and fluff_mm_cache_threaded keep a block's header in the
+ * alignment unit before the pointer given out, which for alignments above
+ * FLUFF_MM_CACHE_LINE would cost more than most blocks. Types aligned beyond
+ * it are carved from chunks like compact types, found from the page map
+ * when freed. They may be shared between threads, so their cache is
+ * guarded by the type's lock.
+ */
+
+/* Registry of paged types, for statistics. Protected by threaded_lock */
+static struct CacheType * paged_types = NULL;
+
+static union FluffData paged_type_new(size_t size, size_t align){
+	struct CacheType * type;
+	union FluffData data;
+
+	if ((type = chunked_type_new(CacheKindPaged, size, align))){
+		pthread_mutex_init(&type->lock, NULL);
+		pthread_mutex_lock(&threaded_lock);
+		if ((type->next_type = paged_types)){
+			paged_types->prev_type = type;
+		}
+		paged_types = type;
+		pthread_mutex_unlock(&threaded_lock);
+		__atomic_store_n(&paged_used, 1, __ATOMIC_RELAXED);
+	}
+	data.d_ptr = type;
+	return data;
+}
+
+static void paged_type_free(struct CacheType * type){
+	pthread_mutex_lock(&threaded_lock);
+	if (type->prev_type){
+		type->prev_type->next_type = type->next_type;
+	} else {
+		paged_types = type->next_type;
+	}
+	if (type->next_type){
+		type->next_type->prev_type = type->prev_type;
+	}
+	pthread_mutex_unlock(&threaded_lock);
+	chunked_type_clear(type);
+	pthread_mutex_destroy(&type->lock);
+	PREV_MM->f_free(type);
+}
+
+static void * paged_alloc(struct CacheType * type){
+	union FluffData data;
+	void * block;
+
+	data.d_ptr = type;
+	pthread_mutex_lock(&type->lock);
+	block = compact_alloc(data);
+	pthread_mutex_unlock(&type->lock);
+	return block;
+}
+
+static size_t paged_alloc_batch(
+		struct CacheType * type, size_t n, void ** dest){
+	union FluffData data;
+	size_t got;
+
+	data.d_ptr = type;
+	pthread_mutex_lock(&type->lock);
+	got = compact_alloc_batch(data, n, dest);
+	pthread_mutex_unlock(&type->lock);
+	return got;
+}
+
+/*
+ * Get the paged type of a block, or NULL if it has a header
+ * Only worth calling once paged_used is set
+ */
+static struct CacheType * paged_type_of(void * block){
+	struct CacheType * type;
+
+	if (!(type = pagemap_get(block)) || type->kind != CacheKindPaged){
+		return NULL;
+	}
+	return type;
+}
+
+/*
+ * Cache a block if it belongs to a paged type
+ * Return 1 if it did, 0 if the block has a header
+ */
+static int paged_free(void * block){
+	struct CacheType * type;
+
+	if (!(type = paged_type_of(block))){
+		return 0;
+	}
+	pthread_mutex_lock(&type->lock);
+	*(void **)block = type->cache;
+	type->cache = block;
+	type->count += 1;
+	STAT_INC(type->counters.frees);
+	pthread_mutex_unlock(&type->lock);
+	return 1;
+}
+
+/*
+ * Prewarming
+ * Reserved blocks are taken from PREV_MM in batches and cached as if they
+ * had just been freed, so they count against the budgets
+ */
+
+static size_t cache_reserve(struct CacheType * type, size_t n){
+	void * blocks[FREE_BATCH];
+	size_t want, room, got, i;
+
+	while (type->count < n){
+		want = n - type->count;
+		if ((room = cache_room(type)) < want){
+			want = room;
+		}
+		if (want > FREE_BATCH){
+			want = FREE_BATCH;
+		}
+		if (!want || !(got = PREV_MM->f_alloc_batch(type->type, want, blocks))){
+			break;
+		}
+		for (i = 0; i < got; ++i){
+			block_init(type, blocks[i]);
+			((struct CacheBlock *)blocks[i])->next = type->cache;
+			type->cache = blocks[i];
+		}
+		type->count += got;
+		cache_bytes += got * type->size;
+	}
+	return type->count;
+}
+
+/*
+ * Fill the depot of a thread-aware type with full magazines
+ */
+static size_t depot_reserve(struct CacheType * type, size_t n){
+	struct Magazine * mag;
+	size_t count, want, i;
+
+	pthread_mutex_lock(&type->lock);
+	count = type->count;
+	pthread_mutex_unlock(&type->lock);
+	while (count < n){
+		if (!(mag = PREV_MM->f_alloc(magazine_size))){
+			break;
+		}
+		want = n - count < MAGAZINE_SIZE ? n - count : MAGAZINE_SIZE;
+		mag->rounds = PREV_MM->f_alloc_batch(type->type, want, mag->round);
+		for (i = 0; i < mag->rounds; ++i){
+			block_init(type, mag->round[i]);
+		}
+		pthread_mutex_lock(&type->lock);
+		if (!mag->rounds || depot_over_budget(type, mag->rounds)){
+			pthread_mutex_unlock(&type->lock);
+			magazine_drain(mag);
+			PREV_MM->f_free(mag);
+			break;
+		}
+		depot_put(type, mag);
+		count = type->count;
+		pthread_mutex_unlock(&type->lock);
+	}
+	return count;
+}
+
+/*
+ * Carve blocks of a compact type into its cache, growing new chunks
+ */
+static size_t compact_reserve(struct CacheType * type, size_t n){
+	void * block;
+
+	while (type->count < n){
+		if (type->bump + type->size > type->end && compact_grow(type)){
+			break;
+		}
+		block = type->bump;
+		type->bump += type->size;
+		*(void **)block = type->cache;
+		type->cache = block;
+		type->count += 1;
+	}
+	return type->count;
+}
+
+size_t fluff_mm_cache_reserve(union FluffData data, size_t n){
+	struct CacheType * type;
+
+	if (!(type = data.d_ptr)){
+		return 0;
+	}
+	switch (type->kind){
+		case CacheKindThreaded:
+			return depot_reserve(type, n);
+		case CacheKindCompact:
+			return compact_reserve(type, n);
+		case CacheKindPaged:
+			pthread_mutex_lock(&type->lock);
+			n = compact_reserve(type, n);
+			pthread_mutex_unlock(&type->lock);
+			return n;
+		default:
+			return cache_reserve(type, n);
+	}
+}
+
+/*
+ * Statistics
+ */
+
+size_t fluff_mm_cache_types(union FluffData * dest, size_t n){
+	struct CacheType * type, * lists[2];
+	size_t count, i;
+
+	count = 0;
+	lists[0] = cache_types;
+	lists[1] = compact_types;
+	for (i = 0; i < 2; ++i){
+		for (type = lists[i]; type; type = type->next_type){
+			if (count < n){
+				dest[count].d_ptr = type;
+			}
+			count += 1;
+		}
+	}
+	pthread_mutex_lock(&threaded_lock);
+	for (i = 0; i < threaded_types_count; ++i){
+		if ((type = threaded_types[i])){
+			if (count < n){
+				dest[count].d_ptr = type;
+			}
+			count += 1;
+		}
+	}
+	for (type = paged_types; type; type = type->next_type){
+		if (count < n){
+			dest[count].d_ptr = type;
+		}
+		count += 1;
+	}
+	pthread_mutex_unlock(&threaded_lock);
+	return count;
+}
+
+static void counters_add(
+		struct FluffMMCacheStats * stats, struct CacheCounters * counters){
+	stats->allocs += __atomic_load_n(&counters->allocs, __ATOMIC_RELAXED);
+	stats->frees += __atomic_load_n(&counters->frees, __ATOMIC_RELAXED);
+	stats->hits += __atomic_load_n(&counters->hits, __ATOMIC_RELAXED);
+	stats->misses += __atomic_load_n(&counters->misses, __ATOMIC_RELAXED);
+}
+
+void fluff_mm_cache_stats(
+		union FluffData data, struct FluffMMCacheStats * stats){
+	struct CacheType * type;
+	struct ThreadCache * tc;
+	struct ThreadMagazines * mags;
+
+	type = data.d_ptr;
+	memset(stats, 0, sizeof(struct FluffMMCacheStats));
+	stats->size = type->size;
+	if (type->kind == CacheKindThreaded){
+		pthread_mutex_lock(&threaded_lock);
+		for (tc = threaded_all; tc; tc = tc->all_next){
+			if ((mags = thread_cache_mags(tc, type->id))){
+				counters_add(stats, &mags->counters);
+			}
+		}
+		pthread_mutex_unlock(&threaded_lock);
+		pthread_mutex_lock(&type->lock);
+		stats->cached = type->count;
+		pthread_mutex_unlock(&type->lock);
+	} else if (type->kind == CacheKindPaged){
+		pthread_mutex_lock(&type->lock);
+		counters_add(stats, &type->counters);
+		stats->cached = type->count;
+		pthread_mutex_unlock(&type->lock);
+	} else {
+		counters_add(stats, &type->counters);
+		stats->cached = type->count;
+	}
+	/* Blocks allocated before statistics were enabled may be freed since */
+	stats->live = stats->allocs > stats->frees
+			? stats->allocs - stats->frees : 0;
+}
+
+int fluff_mm_cache_stats_print(FILE * stream){
+	static const char * kinds[] = {"cache", "threaded", "compact", "paged"};
+	struct FluffMMCacheStats stats;
+	union FluffData * types;
+	size_t count, i;
+	int result = 0;
+
+	if (fprintf(stream, "%-8s %8s %12s %12s %12s %12s %10s %10s\n",
+			"manager", "size", "allocs", "frees", "hits", "misses",
+			"cached", "live") < 0){
+		return -1;
+	}
+	if (!(count = fluff_mm_cache_types(NULL, 0))){
+		return 0;
+	}
+	if (!(types = PREV_MM->f_alloc_size(count * sizeof(union FluffData)))){
+		return -1;
+	}
+	count = fluff_mm_cache_types(types, count);
+	for (i = 0; i < count; ++i){
+		fluff_mm_cache_stats(types[i], &stats);
+		if (fprintf(stream, "%-8s %8zu %12llu %12llu %12llu %12llu %10llu %10llu\n",
+				kinds[((struct CacheType *)types[i].d_ptr)->kind],
+				stats.size, stats.allocs, stats.frees, stats.hits,
+				stats.misses, stats.cached, stats.live) < 0){
+			result = -1;
+			break;
+		}
+	}
+	PREV_MM->f_free(types);
+	return result;
+}
+
 const struct FluffMM * fluff_mm_default = &mm_cache;
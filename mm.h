@@ -19,6 +19,8 @@
 #ifndef FLUFF_MM_H_
 #define FLUFF_MM_H_
 
+#include <stdio.h>
+
 #include "data.h"
 
 /*
@@ -35,11 +37,47 @@ struct FluffMM {
 	void * (*f_alloc)(union FluffData);
 	void * (*f_alloc_size)(size_t);;
 	FluffFreeFunction f_free;
+	/*
+	 * Allocate up to n blocks of a type into dest
+	 * Return the number of blocks allocated
+	 */
+	size_t (*f_alloc_batch)(union FluffData, size_t n, void ** dest);
+	/*
+	 * Free n blocks
+	 */
+	void (*f_free_batch)(void ** blocks, size_t n);
+	/*
+	 * Resize a block from f_alloc_size, keeping its contents
+	 * Return the resized block, or NULL on failure (the block is kept)
+	 */
+	void * (*f_realloc)(void *, size_t);
+	/*
+	 * Create a type whose blocks are aligned to align
+	 * align must be a power of two no greater than FLUFF_MM_MAX_ALIGN.
+	 * fluff_mm_cache and fluff_mm_cache_threaded keep a header of align
+	 * bytes (at least 16) before each block for alignments up to
+	 * FLUFF_MM_CACHE_LINE. Larger alignments have no header: blocks are
+	 * carved from page aligned chunks as with fluff_mm_cache_compact, and
+	 * share its limits on budgets and trimming
+	 */
+	union FluffData (*f_type_new_aligned)(size_t size, size_t align);
 };
 
+/*
+ * Size of a cache line, to keep blocks used by different threads apart
+ */
+#define FLUFF_MM_CACHE_LINE 64
+
+/*
+ * Largest alignment every manager supports, one page
+ */
+#define FLUFF_MM_MAX_ALIGN 4096
+
 /*
  * Memory manager which will be used by modules if not overridden
  * Defaults to fluff_mm_cache
+ * Modules take their manager from it when the library is loaded, so a new
+ * value only takes effect once fluff_init is called (see init.h)
  */
 extern const struct FluffMM * fluff_mm_default;
 
@@ -54,8 +92,180 @@ extern const struct FluffMM * const fluff_mm_system;
 extern const struct FluffMM * const fluff_mm_cache;
 
 /*
- * Set the memory manager used by the caching memory manager
+ * Definition of thread-aware fluff caching manager
+ * Blocks are cached in per-thread magazines which are exchanged with a
+ * shared depot in batches, so it may be used from several threads at once.
+ * The manager it sits on (see fuff_mm_cache_setmm) must be thread safe.
+ * A block freed by a thread other than the one that allocated it is queued
+ * back to its allocating thread, which reuses it on its next cache miss of
+ * the type, or returned to the underlying manager if that thread has exited.
+ * Only the first 4096 types created are cached, blocks of later types go
+ * straight to the underlying manager.
+ * A type may only be freed once no other thread is using it
+ */
+extern const struct FluffMM * const fluff_mm_cache_threaded;
+
+/*
+ * Definition of compact fluff caching manager
+ * Like fluff_mm_cache, but blocks of a type carry no header: they are carved
+ * from page aligned chunks and their type is looked up from the address.
+ * Chunks are only returned when their type is freed, so its types are left
+ * out of the cache budgets and fluff_mm_cache_trim: their cached blocks do
+ * not count against any budget and are never returned early
+ */
+extern const struct FluffMM * const fluff_mm_cache_compact;
+
+/*
+ * Definition of slab manager
+ * Blocks of a type are carved out of 64KiB slabs mapped from the system,
+ * with no per-block header. Slabs that become empty are kept for reuse
+ * within a budget, the rest are unmapped. Sizes requested through
+ * f_alloc_size are served from power of two slab classes, and larger ones
+ * get a mapping of their own, kept for reuse when freed if up to 1MiB.
+ * Useful as the manager under the caching managers
+ */
+extern const struct FluffMM * const fluff_mm_slab;
+
+/*
+ * Set the number of bytes of empty slabs and freed large mappings the slab
+ * manager may keep for reuse instead of unmapping. Defaults to 32MiB
+ */
+void fluff_mm_slab_set_budget(size_t);
+
+/*
+ * Definition of arena manager
+ * Blocks are bump allocated from 64KiB chunks and f_free does nothing; every
+ * block is released at once by fluff_mm_arena_reset. Suited to modules
+ * whose objects all die together, set through their setmm function.
+ * Not thread safe
+ */
+extern const struct FluffMM * const fluff_mm_arena;
+
+/*
+ * Release every block allocated from the arena
+ * Chunks are kept for reuse by later allocations
+ */
+void fluff_mm_arena_reset();
+
+/*
+ * Release every block allocated from the arena and return its chunks
+ */
+void fluff_mm_arena_destroy();
+
+/*
+ * Definition of sampling heap profiler
+ * Passes every call to the manager set by fluff_mm_profile_setmm, recording
+ * a backtrace for about one allocation in each sample interval of bytes.
+ * Live sampled bytes are tracked per call site until the block is freed.
+ * Thread safe if the manager it sits on is
+ */
+extern const struct FluffMM * const fluff_mm_profile;
+
+/*
+ * Set the memory manager used by the heap profiler
+ * Must be set before the profiler is used. Defaults to fluff_mm_cache
+ */
+void fluff_mm_profile_setmm(const struct FluffMM *);
+
+/*
+ * Set the average number of bytes allocated between two samples
+ * 0 samples every allocation. Defaults to 512KiB
+ */
+void fluff_mm_profile_set_interval(size_t);
+
+/*
+ * Write the sampled heap profile in the legacy pprof heap format, followed
+ * by the process's mappings so pprof can symbolize the stacks
+ * Return 0 on success, -1 on failure
+ */
+int fluff_mm_profile_dump(FILE * stream);
+
+/*
+ * Set the memory manager used by the caching memory managers
  */
 void fuff_mm_cache_setmm(const struct FluffMM *);
 
+/*
+ * Set the largest size f_alloc_size of the caching managers will cache
+ * Smaller sizes are rounded up to a power of two and cached per size class.
+ * Defaults to 4096, and is limited to 512KiB
+ */
+void fluff_mm_cache_set_size_cap(size_t);
+
+/*
+ * Set the total number of bytes the caching managers may keep cached
+ * Blocks freed beyond the budget are returned to the underlying manager.
+ * Defaults to no limit
+ */
+void fluff_mm_cache_set_budget(size_t);
+
+/*
+ * Set the number of bytes the caching managers may keep cached for a type
+ * Defaults to no limit. Has no effect on fluff_mm_cache_compact types
+ */
+void fluff_mm_cache_type_set_budget(union FluffData type, size_t);
+
+/*
+ * Return cached blocks to the underlying manager until at most the given
+ * number of bytes remain cached, taking the same fraction from every type.
+ * Blocks in per-thread magazines of fluff_mm_cache_threaded and blocks of
+ * fluff_mm_cache_compact types, or of types aligned beyond
+ * FLUFF_MM_CACHE_LINE, are not trimmed
+ * Return the number of bytes still cached
+ */
+size_t fluff_mm_cache_trim(size_t);
+
+/*
+ * Fill the cache of a caching manager type until it holds n blocks, so the
+ * first allocations of the type do not reach the underlying manager.
+ * Blocks are taken in batches and count against the budgets, except for
+ * fluff_mm_cache_compact types. For fluff_mm_cache_threaded they go to the
+ * shared depot
+ * Return the number of blocks cached for the type, less than n if a budget
+ * was reached or the underlying manager failed
+ */
+size_t fluff_mm_cache_reserve(union FluffData type, size_t n);
+
+/*
+ * Statistics for one type of a caching manager
+ * For fluff_mm_cache_threaded, cached only counts blocks in the shared
+ * depot, not those in per-thread magazines. live is allocs less frees, or 0
+ * when frees of blocks allocated before statistics were enabled outnumber
+ * the allocations
+ */
+struct FluffMMCacheStats {
+	size_t size;
+	unsigned long long allocs;
+	unsigned long long frees;
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long cached;
+	unsigned long long live;
+};
+
+/*
+ * Enable or disable the statistics counters of the caching managers
+ * Counters only advance while enabled. Defaults to disabled
+ */
+void fluff_mm_cache_stats_enable(int);
+
+/*
+ * Get the types registered with the caching managers, including the ones
+ * used for f_alloc_size size classes
+ * Up to n types are stored in dest
+ * Return the number of registered types
+ */
+size_t fluff_mm_cache_types(union FluffData * dest, size_t n);
+
+/*
+ * Snapshot the statistics of a caching manager type
+ */
+void fluff_mm_cache_stats(union FluffData type, struct FluffMMCacheStats *);
+
+/*
+ * Print the statistics of every registered type, one line per type
+ * Return 0 on success, -1 on failure
+ */
+int fluff_mm_cache_stats_print(FILE * stream);
+
 #endif /* FLUFF_MM_H_ */
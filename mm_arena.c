@@ -0,0 +1,230 @@
+/*
+	Copyright 2014 Sky Leonard
+	This file is part of libfluff.
+
+    libfluff is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libfluff is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with libfluff.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "mm.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_CHUNK_SIZE ((size_t)64 * 1024)
+#define ARENA_ALIGN ((size_t)16)
+
+struct ArenaChunk {
+	struct ArenaChunk * next;
+	size_t size;
+};
+
+struct ArenaType {
+	size_t size;
+	size_t align;
+};
+
+#define CHUNK_HEADER \
+	((sizeof(struct ArenaChunk) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+/* Chunks in use, most recent first */
+static struct ArenaChunk * arena_chunks = NULL;
+/* Chunks of ARENA_CHUNK_SIZE kept by reset for reuse */
+static struct ArenaChunk * arena_spare = NULL;
+
+static char * arena_bump = NULL;
+static char * arena_end = NULL;
+/* Most recent block, which may grow in place */
+static char * arena_last = NULL;
+
+/*
+ * Start a new chunk holding a block of size bytes at the given alignment
+ * Chunks are aligned to ARENA_ALIGN, larger alignments are padded for
+ */
+static void * arena_grow(size_t size, size_t align){
+	struct ArenaChunk * chunk;
+	size_t chunk_size;
+	char * block;
+
+	chunk_size = CHUNK_HEADER + size + (align - ARENA_ALIGN);
+	if (chunk_size <= ARENA_CHUNK_SIZE && (chunk = arena_spare)){
+		arena_spare = chunk->next;
+	} else {
+		if (chunk_size < ARENA_CHUNK_SIZE){
+			chunk_size = ARENA_CHUNK_SIZE;
+		}
+		if (!(chunk = malloc(chunk_size))){
+			return NULL;
+		}
+		chunk->size = chunk_size;
+	}
+	chunk->next = arena_chunks;
+	arena_chunks = chunk;
+	block = (char *)(((uintptr_t)chunk + CHUNK_HEADER + align - 1)
+			& ~(uintptr_t)(align - 1));
+	if (chunk->size == ARENA_CHUNK_SIZE){
+		arena_bump = block + size;
+		arena_end = (char *)chunk + chunk->size;
+		arena_last = block;
+	}
+	return block;
+}
+
+static union FluffData arena_type_new_aligned(size_t size, size_t align){
+	struct ArenaType * type;
+	union FluffData as_data;
+
+	if ((type = malloc(sizeof(struct ArenaType)))){
+		type->size = size;
+		type->align = align < ARENA_ALIGN ? ARENA_ALIGN : align;
+	}
+	as_data.d_ptr = type;
+	return as_data;
+}
+
+static union FluffData arena_type_new(size_t size){
+	return arena_type_new_aligned(size, ARENA_ALIGN);
+}
+
+/*
+ * Types outlive fluff_mm_arena_reset, so they are not kept in the arena
+ */
+static void arena_type_free(union FluffData data){
+	free(data.d_ptr);
+}
+
+static void * arena_alloc_aligned(size_t size, size_t align){
+	char * block;
+
+	/* Empty blocks take room too, so they are never NULL and never shared */
+	if (!size){
+		size = ARENA_ALIGN;
+	}
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	block = (char *)(((uintptr_t)arena_bump + align - 1)
+			& ~(uintptr_t)(align - 1));
+	if (block > arena_end || size > (size_t)(arena_end - block)){
+		return arena_grow(size, align);
+	}
+	arena_last = block;
+	arena_bump = block + size;
+	return block;
+}
+
+/*
+ * Blocks of a given size start with a header of ARENA_ALIGN bytes holding
+ * that size, for arena_realloc
+ */
+static void * arena_alloc_size(size_t size){
+	char * header;
+
+	header = arena_alloc_aligned(
+			(size ? size : 1) + ARENA_ALIGN, ARENA_ALIGN);
+	if (!header){
+		return NULL;
+	}
+	*(size_t *)header = size;
+	return header + ARENA_ALIGN;
+}
+
+static void * arena_alloc(union FluffData as_data){
+	struct ArenaType * type;
+
+	if (!(type = as_data.d_ptr)){
+		return NULL;
+	}
+	return arena_alloc_aligned(type->size, type->align);
+}
+
+static void arena_free(void * block){
+	// Do nothing, blocks are released by fluff_mm_arena_reset
+	(void)block;
+}
+
+static size_t arena_alloc_batch(
+		union FluffData as_data, size_t n, void ** dest){
+	size_t i;
+
+	for (i = 0; i < n && (dest[i] = arena_alloc(as_data)); ++i);
+	return i;
+}
+
+static void arena_free_batch(void ** blocks, size_t n){
+	// Do nothing
+	(void)blocks;
+	(void)n;
+}
+
+/*
+ * The last block grows or shrinks in place, others are copied to a new block
+ */
+static void * arena_realloc(void * block, size_t size){
+	char * header, * new_block;
+	size_t old, room;
+
+	if (block == NULL){
+		return arena_alloc_size(size);
+	}
+	header = (char *)block - ARENA_ALIGN;
+	old = *(size_t *)header;
+	/* Like arena_alloc_aligned, an empty block keeps some room */
+	room = ((size ? size : 1) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (header == arena_last && room <= (size_t)(arena_end - (char *)block)){
+		*(size_t *)header = size;
+		arena_bump = (char *)block + room;
+		return block;
+	}
+	if (!(new_block = arena_alloc_size(size))){
+		return NULL;
+	}
+	memcpy(new_block, block, old < size ? old : size);
+	return new_block;
+}
+
+void fluff_mm_arena_reset(){
+	struct ArenaChunk * chunk;
+
+	while ((chunk = arena_chunks)){
+		arena_chunks = chunk->next;
+		if (chunk->size == ARENA_CHUNK_SIZE){
+			chunk->next = arena_spare;
+			arena_spare = chunk;
+		} else {
+			free(chunk);
+		}
+	}
+	arena_bump = arena_end = arena_last = NULL;
+}
+
+void fluff_mm_arena_destroy(){
+	struct ArenaChunk * chunk;
+
+	fluff_mm_arena_reset();
+	while ((chunk = arena_spare)){
+		arena_spare = chunk->next;
+		free(chunk);
+	}
+}
+
+const struct FluffMM mm_arena = {
+		&arena_type_new,
+		&arena_type_free,
+		&arena_alloc,
+		&arena_alloc_size,
+		&arena_free,
+		&arena_alloc_batch,
+		&arena_free_batch,
+		&arena_realloc,
+		&arena_type_new_aligned,
+};
+
+const struct FluffMM * const fluff_mm_arena = &mm_arena;
@@ -0,0 +1,436 @@
+/*
+	Copyright 2014 Sky Leonard
+	This file is part of libfluff.
+
+    libfluff is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libfluff is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with libfluff.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "mm.h"
+
+#include <execinfo.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+/*
+ * Every call is passed to PREV_MM. The gap in bytes between two samples is
+ * drawn from an exponential distribution with a mean of interval bytes, so
+ * bytes are sampled as a Poisson process and an allocation of size bytes is
+ * sampled with probability 1 - exp(-size / interval). That is what pprof
+ * assumes when it scales heap_v2 samples back up. A sampled block is
+ * recorded in a table keyed by its address and charged to the site of its
+ * backtrace until freed.
+ *
+ * Frees check a table of counters indexed by a hash of the address before
+ * taking the lock, so blocks that were never sampled cost no locking.
+ */
+#define PROFILE_DEPTH 32
+#define PROFILE_SKIP 2 /* profile_record and the manager function */
+#define SITE_BITS 10
+#define SAMPLE_BITS 12
+#define FILTER_BITS 14
+
+struct ProfileType {
+	union FluffData type;
+	size_t size;
+};
+
+struct ProfileSite {
+	struct ProfileSite * next;
+	uint64_t hash;
+	int depth;
+	void * stack[PROFILE_DEPTH];
+	unsigned long long live_objs;
+	unsigned long long live_bytes;
+	unsigned long long alloc_objs;
+	unsigned long long alloc_bytes;
+};
+
+struct ProfileSample {
+	struct ProfileSample * next;
+	void * block;
+	size_t size;
+	struct ProfileSite * site;
+};
+
+static const struct FluffMM * PREV_MM = NULL;
+
+static size_t sample_interval = 512 * 1024;
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ProfileSite * sites[1 << SITE_BITS];
+static struct ProfileSample * samples[1 << SAMPLE_BITS];
+static unsigned int filter[1 << FILTER_BITS];
+
+static __thread size_t sample_countdown = 0;
+static __thread uint64_t sample_rand = 0;
+
+static inline uint64_t hash_ptr(void * ptr){
+	return ((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ull;
+}
+
+#define FILTER_INDEX(ptr) (hash_ptr(ptr) >> (64 - FILTER_BITS))
+#define SAMPLE_INDEX(ptr) (hash_ptr(ptr) >> (64 - SAMPLE_BITS))
+
+static size_t next_gap(){
+	double u;
+
+	if (!sample_rand){
+		sample_rand = hash_ptr(&sample_rand) | 1;
+	}
+	sample_rand ^= sample_rand << 13;
+	sample_rand ^= sample_rand >> 7;
+	sample_rand ^= sample_rand << 17;
+	/* The top 53 bits make u uniform in (0, 1] */
+	u = ((sample_rand >> 11) + 1) * (1.0 / ((uint64_t)1 << 53));
+	return 1 + (size_t)(-log(u) * sample_interval);
+}
+
+/*
+ * Count an allocation towards the next sample
+ * Return 1 if the allocation should be sampled
+ */
+static inline int profile_tick(size_t size){
+	if (!sample_interval){
+		return 1;
+	}
+	if (!sample_countdown){
+		sample_countdown = next_gap();
+	}
+	if (size < sample_countdown){
+		sample_countdown -= size;
+		return 0;
+	}
+	sample_countdown = next_gap();
+	return 1;
+}
+
+static uint64_t hash_stack(void ** stack, int depth){
+	uint64_t hash;
+	int i;
+
+	hash = depth;
+	for (i = 0; i < depth; ++i){
+		hash = (hash ^ (uintptr_t)stack[i]) * 0x100000001B3ull;
+	}
+	return hash;
+}
+
+/*
+ * Find or create the site of a stack, profile_lock must be held
+ */
+static struct ProfileSite * site_get(void ** stack, int depth){
+	struct ProfileSite * site, ** bucket;
+	uint64_t hash;
+	int i;
+
+	hash = hash_stack(stack, depth);
+	bucket = sites + (hash >> (64 - SITE_BITS));
+	for (site = *bucket; site; site = site->next){
+		if (site->hash == hash && site->depth == depth){
+			for (i = 0; i < depth && site->stack[i] == stack[i]; ++i);
+			if (i == depth){
+				return site;
+			}
+		}
+	}
+	if ((site = calloc(1, sizeof(struct ProfileSite)))){
+		site->hash = hash;
+		site->depth = depth;
+		for (i = 0; i < depth; ++i){
+			site->stack[i] = stack[i];
+		}
+		site->next = *bucket;
+		*bucket = site;
+	}
+	return site;
+}
+
+/*
+ * Record a sampled block
+ * Must be called directly by the manager function, see PROFILE_SKIP
+ */
+static __attribute__((noinline)) void profile_record(void * block, size_t size){
+	void * stack[PROFILE_DEPTH + PROFILE_SKIP];
+	struct ProfileSample * sample, ** bucket;
+	struct ProfileSite * site;
+	int depth;
+
+	if (!(sample = malloc(sizeof(struct ProfileSample)))){
+		return;
+	}
+	depth = backtrace(stack, PROFILE_DEPTH + PROFILE_SKIP) - PROFILE_SKIP;
+	if (depth < 0){
+		depth = 0;
+	}
+	pthread_mutex_lock(&profile_lock);
+	if (!(site = site_get(stack + PROFILE_SKIP, depth))){
+		pthread_mutex_unlock(&profile_lock);
+		free(sample);
+		return;
+	}
+	site->live_objs += 1;
+	site->live_bytes += size;
+	site->alloc_objs += 1;
+	site->alloc_bytes += size;
+	sample->block = block;
+	sample->size = size;
+	sample->site = site;
+	bucket = samples + SAMPLE_INDEX(block);
+	sample->next = *bucket;
+	*bucket = sample;
+	__atomic_add_fetch(filter + FILTER_INDEX(block), 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&profile_lock);
+}
+
+/*
+ * Take the sample of a block out of the table, if it was sampled
+ * Return the sample, or NULL
+ */
+static struct ProfileSample * profile_take(void * block){
+	struct ProfileSample * sample, ** link;
+
+	if (!__atomic_load_n(filter + FILTER_INDEX(block), __ATOMIC_RELAXED)){
+		return NULL;
+	}
+	pthread_mutex_lock(&profile_lock);
+	for (link = samples + SAMPLE_INDEX(block); (sample = *link);
+			link = &sample->next){
+		if (sample->block == block){
+			*link = sample->next;
+			sample->site->live_objs -= 1;
+			sample->site->live_bytes -= sample->size;
+			__atomic_sub_fetch(filter + FILTER_INDEX(block), 1,
+					__ATOMIC_RELAXED);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&profile_lock);
+	return sample;
+}
+
+/*
+ * Put back a sample taken by profile_take
+ */
+static void profile_put(struct ProfileSample * sample){
+	struct ProfileSample ** bucket;
+
+	pthread_mutex_lock(&profile_lock);
+	sample->site->live_objs += 1;
+	sample->site->live_bytes += sample->size;
+	bucket = samples + SAMPLE_INDEX(sample->block);
+	sample->next = *bucket;
+	*bucket = sample;
+	__atomic_add_fetch(filter + FILTER_INDEX(sample->block), 1,
+			__ATOMIC_RELAXED);
+	pthread_mutex_unlock(&profile_lock);
+}
+
+/*
+ * Forget a block if it was sampled
+ */
+static void profile_forget(void * block){
+	free(profile_take(block));
+}
+
+static void setup_mm(){
+	if (PREV_MM == NULL){
+		PREV_MM = fluff_mm_cache;
+	}
+}
+
+static void __attribute__((constructor)) init_mm(){
+	setup_mm();
+}
+
+void fluff_mm_profile_setmm(const struct FluffMM * mm){
+	PREV_MM = mm;
+}
+
+void fluff_mm_profile_set_interval(size_t bytes){
+	sample_interval = bytes;
+}
+
+static union FluffData profile_type_new_aligned(size_t size, size_t align){
+	struct ProfileType * type;
+	union FluffData data;
+
+	if ((type = malloc(sizeof(struct ProfileType)))){
+		type->size = size;
+		type->type = align
+				? PREV_MM->f_type_new_aligned(size, align)
+				: PREV_MM->f_type_new(size);
+	}
+	data.d_ptr = type;
+	return data;
+}
+
+static union FluffData profile_type_new(size_t size){
+	return profile_type_new_aligned(size, 0);
+}
+
+static void profile_type_free(union FluffData data){
+	struct ProfileType * type;
+
+	type = data.d_ptr;
+	PREV_MM->f_type_free(type->type);
+	free(type);
+}
+
+static void * profile_alloc(union FluffData data){
+	struct ProfileType * type;
+	void * block;
+
+	if (!(type = data.d_ptr)){
+		return NULL;
+	}
+	if ((block = PREV_MM->f_alloc(type->type)) && profile_tick(type->size)){
+		profile_record(block, type->size);
+	}
+	return block;
+}
+
+static void * profile_alloc_size(size_t size){
+	void * block;
+
+	if ((block = PREV_MM->f_alloc_size(size)) && profile_tick(size)){
+		profile_record(block, size);
+	}
+	return block;
+}
+
+static void profile_free(void * block){
+	profile_forget(block);
+	PREV_MM->f_free(block);
+}
+
+static size_t profile_alloc_batch(
+		union FluffData data, size_t n, void ** dest){
+	struct ProfileType * type;
+	size_t got, i;
+
+	if (!(type = data.d_ptr)){
+		return 0;
+	}
+	got = PREV_MM->f_alloc_batch(type->type, n, dest);
+	for (i = 0; i < got; ++i){
+		if (profile_tick(type->size)){
+			profile_record(dest[i], type->size);
+		}
+	}
+	return got;
+}
+
+static void profile_free_batch(void ** blocks, size_t n){
+	size_t i;
+
+	for (i = 0; i < n; ++i){
+		profile_forget(blocks[i]);
+	}
+	PREV_MM->f_free_batch(blocks, n);
+}
+
+static void * profile_realloc(void * block, size_t size){
+	struct ProfileSample * sample;
+	void * new_block;
+
+	/*
+	 * Forget the block before PREV_MM may free it, or another thread could
+	 * be given its address and sampled before it is forgotten
+	 */
+	sample = block ? profile_take(block) : NULL;
+	if (!(new_block = PREV_MM->f_realloc(block, size))){
+		if (sample){
+			profile_put(sample);
+		}
+		return NULL;
+	}
+	/* A sampled block stays sampled, at its new size */
+	if (sample){
+		free(sample);
+		profile_record(new_block, size);
+	} else if (profile_tick(size)){
+		profile_record(new_block, size);
+	}
+	return new_block;
+}
+
+const struct FluffMM mm_profile = {
+		&profile_type_new,
+		&profile_type_free,
+		&profile_alloc,
+		&profile_alloc_size,
+		&profile_free,
+		&profile_alloc_batch,
+		&profile_free_batch,
+		&profile_realloc,
+		&profile_type_new_aligned,
+};
+
+const struct FluffMM * const fluff_mm_profile = &mm_profile;
+
+static int maps_copy(FILE * stream){
+	FILE * maps;
+	char buffer[4096];
+	size_t n;
+
+	if (!(maps = fopen("/proc/self/maps", "r"))){
+		return -1;
+	}
+	while ((n = fread(buffer, 1, sizeof(buffer), maps))){
+		if (fwrite(buffer, 1, n, stream) != n){
+			fclose(maps);
+			return -1;
+		}
+	}
+	fclose(maps);
+	return 0;
+}
+
+int fluff_mm_profile_dump(FILE * stream){
+	struct ProfileSite * site;
+	unsigned long long live_objs, live_bytes, alloc_objs, alloc_bytes;
+	size_t i;
+	int k, res;
+
+	live_objs = live_bytes = alloc_objs = alloc_bytes = 0;
+	pthread_mutex_lock(&profile_lock);
+	for (i = 0; i < (1 << SITE_BITS); ++i){
+		for (site = sites[i]; site; site = site->next){
+			live_objs += site->live_objs;
+			live_bytes += site->live_bytes;
+			alloc_objs += site->alloc_objs;
+			alloc_bytes += site->alloc_bytes;
+		}
+	}
+	res = fprintf(stream, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu\n",
+			live_objs, live_bytes, alloc_objs, alloc_bytes, sample_interval);
+	for (i = 0; res >= 0 && i < (1 << SITE_BITS); ++i){
+		for (site = sites[i]; res >= 0 && site; site = site->next){
+			res = fprintf(stream, "%llu: %llu [%llu: %llu] @",
+					site->live_objs, site->live_bytes,
+					site->alloc_objs, site->alloc_bytes);
+			for (k = 0; res >= 0 && k < site->depth; ++k){
+				res = fprintf(stream, " %p", site->stack[k]);
+			}
+			if (res >= 0){
+				res = fputc('\n', stream);
+			}
+		}
+	}
+	pthread_mutex_unlock(&profile_lock);
+	if (res < 0 || fputs("\nMAPPED_LIBRARIES:\n", stream) < 0){
+		return -1;
+	}
+	return maps_copy(stream);
+}
@@ -0,0 +1,569 @@
+/*
+	Copyright 2014 Sky Leonard
+	This file is part of libfluff.
+
+    libfluff is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libfluff is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with libfluff.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+
+#include "mm.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/*
+ * Slabs are SLAB_SIZE bytes, mapped at SLAB_SIZE alignment so the header of
+ * the slab owning any block can be found by masking the block's address.
+ * Blocks too large to share a slab get a mapping of their own, which also
+ * starts with a header.
+ *
+ * Mapping and unmapping is what makes the system slow here, so slabs of a
+ * type which become empty are kept in a pool for reuse, and large mappings
+ * up to LARGE_MAX are made in power of two sizes and kept on a list of
+ * their size when freed. Together they hold at most slab_budget bytes.
+ */
+#define SLAB_SHIFT 16
+#define SLAB_SIZE ((size_t)1 << SLAB_SHIFT)
+#define SLAB_MASK (~(SLAB_SIZE - 1))
+#define SLAB_MAX_BLOCK (SLAB_SIZE / 8)
+#define SLAB_MIN_CLASS 16
+#define SLAB_N_CLASSES 10 /* 16 .. SLAB_MAX_BLOCK */
+#define LARGE_MIN_SHIFT 14
+#define LARGE_N_CLASSES 7 /* 16KiB .. LARGE_MAX */
+#define LARGE_MAX ((size_t)1 << (LARGE_MIN_SHIFT + LARGE_N_CLASSES - 1))
+
+#define BITS_PER_WORD 64
+
+struct SlabType {
+	size_t size;
+	size_t offset;
+	unsigned int per_slab;
+	unsigned int n_words;
+	pthread_mutex_t lock;
+	struct Slab * partial;
+	/* Empty slabs kept for reuse, linked by next */
+	struct Slab * empty;
+};
+
+struct Slab {
+	struct SlabType * type; /* NULL for a large block */
+	struct Slab * prev;
+	struct Slab * next;
+	size_t length;
+	unsigned int n_free;
+	unsigned int hint;
+	uint64_t bits[]; /* Set bits are free blocks */
+};
+
+#define LARGE_OFFSET ((sizeof(struct Slab) + 15) & ~(size_t)15)
+
+static struct SlabType slab_classes[SLAB_N_CLASSES];
+static pthread_once_t slab_classes_once = PTHREAD_ONCE_INIT;
+
+/* Freed large mappings of each power of two size, linked by next */
+static struct Slab * large_cache[LARGE_N_CLASSES];
+static pthread_mutex_t large_locks[LARGE_N_CLASSES] = {
+		[0 ... LARGE_N_CLASSES - 1] = PTHREAD_MUTEX_INITIALIZER};
+
+static size_t slab_budget = 32 * 1024 * 1024;
+static size_t slab_pooled = 0;
+
+void fluff_mm_slab_set_budget(size_t bytes){
+	slab_budget = bytes;
+}
+
+/*
+ * Count bytes about to be kept for reuse
+ * Return 1 if they fit in the budget, 0 if they should be unmapped
+ */
+static int pool_take_room(size_t bytes){
+	size_t pooled;
+
+	pooled = __atomic_load_n(&slab_pooled, __ATOMIC_RELAXED);
+	do {
+		if (pooled + bytes > slab_budget){
+			return 0;
+		}
+	} while (!__atomic_compare_exchange_n(&slab_pooled, &pooled,
+			pooled + bytes, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return 1;
+}
+
+static inline void pool_give_room(size_t bytes){
+	__atomic_sub_fetch(&slab_pooled, bytes, __ATOMIC_RELAXED);
+}
+
+static void * map_aligned(size_t length){
+	char * map;
+	uintptr_t addr, aligned;
+
+	map = mmap(NULL, length + SLAB_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED){
+		return NULL;
+	}
+	addr = (uintptr_t)map;
+	aligned = (addr + SLAB_SIZE - 1) & SLAB_MASK;
+	if (aligned > addr){
+		munmap(map, aligned - addr);
+	}
+	munmap((void *)(aligned + length), addr + SLAB_SIZE - aligned);
+	return (void *)aligned;
+}
+
+/*
+ * Blocks are kept aligned by rounding the size and the offset of the first
+ * block up to the alignment, slabs themselves being aligned far beyond it
+ */
+static void slab_type_init(struct SlabType * type, size_t size, size_t align){
+	unsigned int per_slab, n_words;
+	size_t offset, offset_align;
+
+	if (align < 8){
+		align = 8;
+	}
+	offset_align = align > 16 ? align : 16;
+	size = (size + align - 1) & ~(align - 1);
+	type->size = size ?: align;
+	type->partial = NULL;
+	type->empty = NULL;
+	pthread_mutex_init(&type->lock, NULL);
+	if (size > SLAB_MAX_BLOCK){
+		type->per_slab = 0;
+		type->n_words = 0;
+		type->offset = (LARGE_OFFSET + offset_align - 1) & ~(offset_align - 1);
+		return;
+	}
+	per_slab = (SLAB_SIZE - sizeof(struct Slab)) / type->size;
+	while (1){
+		n_words = (per_slab + BITS_PER_WORD - 1) / BITS_PER_WORD;
+		offset = sizeof(struct Slab) + n_words * sizeof(uint64_t);
+		offset = (offset + offset_align - 1) & ~(offset_align - 1);
+		if (offset + per_slab * type->size <= SLAB_SIZE){
+			break;
+		}
+		per_slab -= 1;
+	}
+	type->per_slab = per_slab;
+	type->n_words = n_words;
+	type->offset = offset;
+}
+
+static void slab_classes_init(){
+	int i;
+
+	for (i = 0; i < SLAB_N_CLASSES; ++i){
+		slab_type_init(slab_classes + i, SLAB_MIN_CLASS << i, 8);
+	}
+}
+
+/*
+ * Get an empty slab for a type, from its pool if it has one
+ * The type's lock must be held
+ */
+static struct Slab * slab_new(struct SlabType * type){
+	struct Slab * slab;
+	unsigned int i, rem;
+
+	if ((slab = type->empty)){
+		type->empty = slab->next;
+		pool_give_room(SLAB_SIZE);
+	} else if (!(slab = map_aligned(SLAB_SIZE))){
+		return NULL;
+	}
+	slab->type = type;
+	slab->prev = NULL;
+	slab->next = NULL;
+	slab->length = SLAB_SIZE;
+	slab->n_free = type->per_slab;
+	slab->hint = 0;
+	for (i = 0; i < type->n_words; ++i){
+		slab->bits[i] = ~(uint64_t)0;
+	}
+	if ((rem = type->per_slab % BITS_PER_WORD)){
+		slab->bits[type->n_words - 1] = ((uint64_t)1 << rem) - 1;
+	}
+	return slab;
+}
+
+static void partial_unlink(struct SlabType * type, struct Slab * slab){
+	if (slab->prev){
+		slab->prev->next = slab->next;
+	} else {
+		type->partial = slab->next;
+	}
+	if (slab->next){
+		slab->next->prev = slab->prev;
+	}
+	slab->prev = slab->next = NULL;
+}
+
+static void partial_push(struct SlabType * type, struct Slab * slab){
+	slab->prev = NULL;
+	slab->next = type->partial;
+	if (type->partial){
+		type->partial->prev = slab;
+	}
+	type->partial = slab;
+}
+
+/*
+ * Get the class of a large mapping's length
+ * Return the index, or -1 if mappings of the length are not cached
+ */
+static int large_class(size_t length){
+	int i;
+
+	for (i = 0; i < LARGE_N_CLASSES
+			&& ((size_t)1 << (LARGE_MIN_SHIFT + i)) < length; ++i);
+	return i < LARGE_N_CLASSES ? i : -1;
+}
+
+static void * large_alloc(size_t size, size_t offset){
+	struct Slab * slab;
+	size_t length;
+	int i;
+
+	length = (offset + size + 4095) & ~(size_t)4095;
+	if ((i = large_class(length)) >= 0){
+		length = (size_t)1 << (LARGE_MIN_SHIFT + i);
+		pthread_mutex_lock(large_locks + i);
+		if ((slab = large_cache[i])){
+			large_cache[i] = slab->next;
+		}
+		pthread_mutex_unlock(large_locks + i);
+		if (slab){
+			pool_give_room(length);
+			return (char *)slab + offset;
+		}
+	}
+	if (!(slab = map_aligned(length))){
+		return NULL;
+	}
+	slab->type = NULL;
+	slab->length = length;
+	return (char *)slab + offset;
+}
+
+/*
+ * Keep a large mapping for reuse if it has a class size and fits in the
+ * budget, otherwise unmap it
+ */
+static void large_free(struct Slab * slab){
+	int i;
+
+	if ((i = large_class(slab->length)) < 0
+			|| slab->length != (size_t)1 << (LARGE_MIN_SHIFT + i)
+			|| !pool_take_room(slab->length)){
+		munmap(slab, slab->length);
+		return;
+	}
+	pthread_mutex_lock(large_locks + i);
+	slab->next = large_cache[i];
+	large_cache[i] = slab;
+	pthread_mutex_unlock(large_locks + i);
+}
+
+static void * slab_type_alloc(struct SlabType * type){
+	struct Slab * slab;
+	unsigned int word, bit;
+
+	if (!type->per_slab){
+		return large_alloc(type->size, type->offset);
+	}
+	pthread_mutex_lock(&type->lock);
+	if (!(slab = type->partial)){
+		if (!(slab = slab_new(type))){
+			pthread_mutex_unlock(&type->lock);
+			return NULL;
+		}
+		partial_push(type, slab);
+	}
+	word = slab->hint;
+	while (!slab->bits[word]){
+		word += 1;
+	}
+	bit = __builtin_ctzll(slab->bits[word]);
+	slab->bits[word] &= slab->bits[word] - 1;
+	slab->hint = word;
+	if (!--slab->n_free){
+		partial_unlink(type, slab);
+	}
+	pthread_mutex_unlock(&type->lock);
+	return (char *)slab + type->offset
+			+ (word * BITS_PER_WORD + bit) * type->size;
+}
+
+/*
+ * Take up to n blocks from a type's slabs under one hold of its lock
+ * Return the number of blocks taken
+ */
+static size_t slab_type_alloc_batch(
+		struct SlabType * type, size_t n, void ** dest){
+	struct Slab * slab;
+	unsigned int word, bit;
+	size_t i;
+
+	i = 0;
+	pthread_mutex_lock(&type->lock);
+	while (i < n){
+		if (!(slab = type->partial)){
+			if (!(slab = slab_new(type))){
+				break;
+			}
+			partial_push(type, slab);
+		}
+		word = slab->hint;
+		while (i < n && slab->n_free){
+			while (!slab->bits[word]){
+				word += 1;
+			}
+			bit = __builtin_ctzll(slab->bits[word]);
+			slab->bits[word] &= slab->bits[word] - 1;
+			slab->n_free -= 1;
+			dest[i++] = (char *)slab + type->offset
+					+ (word * BITS_PER_WORD + bit) * type->size;
+		}
+		slab->hint = word;
+		if (!slab->n_free){
+			partial_unlink(type, slab);
+		}
+	}
+	pthread_mutex_unlock(&type->lock);
+	return i;
+}
+
+static union FluffData slab_type_new_aligned(size_t size, size_t align){
+	struct SlabType * type;
+	union FluffData data;
+
+	if ((type = malloc(sizeof(struct SlabType)))){
+		slab_type_init(type, size, align);
+	}
+	data.d_ptr = type;
+	return data;
+}
+
+static union FluffData slab_type_new(size_t size){
+	return slab_type_new_aligned(size, 8);
+}
+
+/*
+ * Slabs with free blocks are returned to the system with the type, every
+ * block of the type should be freed first
+ */
+static void slab_type_free(union FluffData data){
+	struct SlabType * type;
+	struct Slab * slab;
+
+	type = data.d_ptr;
+	while ((slab = type->partial)){
+		type->partial = slab->next;
+		munmap(slab, slab->length);
+	}
+	while ((slab = type->empty)){
+		type->empty = slab->next;
+		pool_give_room(SLAB_SIZE);
+		munmap(slab, slab->length);
+	}
+	pthread_mutex_destroy(&type->lock);
+	free(type);
+}
+
+static void * slab_alloc(union FluffData data){
+	if (data.d_ptr == NULL){
+		return NULL;
+	}
+	return slab_type_alloc(data.d_ptr);
+}
+
+static void * slab_alloc_size(size_t size){
+	size_t i;
+
+	if (size > SLAB_MAX_BLOCK){
+		return large_alloc(size, LARGE_OFFSET);
+	}
+	pthread_once(&slab_classes_once, &slab_classes_init);
+	for (i = 0; ((size_t)SLAB_MIN_CLASS << i) < size; ++i);
+	return slab_type_alloc(slab_classes + i);
+}
+
+/*
+ * Mark a block free, the type's lock must be held
+ * A slab which becomes empty goes to the type's pool while there is room
+ * Return the slab if it became empty and should be unmapped, else NULL
+ */
+static struct Slab * slab_put(
+		struct SlabType * type, struct Slab * slab, void * block){
+	size_t index;
+
+	index = ((char *)block - (char *)slab - type->offset) / type->size;
+	slab->bits[index / BITS_PER_WORD] |= (uint64_t)1 << (index % BITS_PER_WORD);
+	if (index / BITS_PER_WORD < slab->hint){
+		slab->hint = index / BITS_PER_WORD;
+	}
+	if (!slab->n_free++){
+		partial_push(type, slab);
+	} else if (slab->n_free == type->per_slab
+			&& (slab->prev || slab->next)){
+		/* Empty, and not the only slab with room left */
+		partial_unlink(type, slab);
+		if (pool_take_room(SLAB_SIZE)){
+			slab->next = type->empty;
+			type->empty = slab;
+			return NULL;
+		}
+		return slab;
+	}
+	return NULL;
+}
+
+static void slab_free(void * block){
+	struct SlabType * type;
+	struct Slab * slab;
+
+	if (block == NULL){
+		return;
+	}
+	slab = (struct Slab *)((uintptr_t)block & SLAB_MASK);
+	if (!(type = slab->type)){
+		large_free(slab);
+		return;
+	}
+	pthread_mutex_lock(&type->lock);
+	slab = slab_put(type, slab, block);
+	pthread_mutex_unlock(&type->lock);
+	if (slab){
+		munmap(slab, slab->length);
+	}
+}
+
+static size_t slab_alloc_batch(union FluffData data, size_t n, void ** dest){
+	struct SlabType * type;
+	size_t i;
+
+	if (!(type = data.d_ptr)){
+		return 0;
+	}
+	if (type->per_slab){
+		return slab_type_alloc_batch(type, n, dest);
+	}
+	for (i = 0; i < n && (dest[i] = large_alloc(type->size, type->offset));
+			++i);
+	return i;
+}
+
+/*
+ * Resize a large block by moving its pages to a new aligned mapping,
+ * so the contents are never copied
+ */
+static void * large_realloc(struct Slab * slab, size_t size){
+	struct Slab * new_slab;
+	size_t length;
+
+	length = (LARGE_OFFSET + size + 4095) & ~(size_t)4095;
+	if (length <= slab->length){
+		return (char *)slab + LARGE_OFFSET;
+	}
+	/* Grow in place if the pages after the block are free */
+	if (mremap(slab, slab->length, length, 0) != MAP_FAILED){
+		slab->length = length;
+		return (char *)slab + LARGE_OFFSET;
+	}
+	if (!(new_slab = map_aligned(length))){
+		return NULL;
+	}
+	if (mremap(slab, slab->length, length, MREMAP_MAYMOVE | MREMAP_FIXED,
+			new_slab) == MAP_FAILED){
+		munmap(new_slab, length);
+		return NULL;
+	}
+	new_slab->length = length;
+	return (char *)new_slab + LARGE_OFFSET;
+}
+
+static void * slab_realloc(void * block, size_t size){
+	struct SlabType * type;
+	struct Slab * slab;
+	void * new_block;
+
+	if (block == NULL){
+		return slab_alloc_size(size);
+	}
+	slab = (struct Slab *)((uintptr_t)block & SLAB_MASK);
+	if (!(type = slab->type)){
+		return large_realloc(slab, size);
+	}
+	if (size <= type->size){
+		return block;
+	}
+	if ((new_block = slab_alloc_size(size))){
+		memcpy(new_block, block, type->size);
+		slab_free(block);
+	}
+	return new_block;
+}
+
+/*
+ * Free blocks, taking a type's lock once for each run of blocks of the type
+ */
+static void slab_free_batch(void ** blocks, size_t n){
+	struct SlabType * type;
+	struct Slab * slab, * empty;
+	size_t i;
+
+	i = 0;
+	while (i < n){
+		slab = (struct Slab *)((uintptr_t)blocks[i] & SLAB_MASK);
+		if (!(type = slab->type)){
+			large_free(slab);
+			i += 1;
+			continue;
+		}
+		empty = NULL;
+		pthread_mutex_lock(&type->lock);
+		do {
+			if ((slab = slab_put(type, slab, blocks[i]))){
+				/* Reuse the list link, the slab is off the partial list */
+				slab->next = empty;
+				empty = slab;
+			}
+			if (++i == n){
+				break;
+			}
+			slab = (struct Slab *)((uintptr_t)blocks[i] & SLAB_MASK);
+		} while (slab->type == type);
+		pthread_mutex_unlock(&type->lock);
+		while ((slab = empty)){
+			empty = slab->next;
+			munmap(slab, slab->length);
+		}
+	}
+}
+
+const struct FluffMM mm_slab = {
+		&slab_type_new,
+		&slab_type_free,
+		&slab_alloc,
+		&slab_alloc_size,
+		&slab_free,
+		&slab_alloc_batch,
+		&slab_free_batch,
+		&slab_realloc,
+		&slab_type_new_aligned,
+};
+
+const struct FluffMM * const fluff_mm_slab = &mm_slab;
@@ -26,12 +26,19 @@
 #include "set.h"
 #include "traceback.h"
 
+#define FREE_BATCH 32
+
 struct FluffNetwork {
 	enum FluffNetworkSendOpt send_opt;
 	FluffFreeFunction send_freer;
 	struct FluffSocketSet * sockets;
 	struct FluffSetElement * connecting;
 	struct FluffSetElement * handles;
+	const struct FluffMM * mm;
+	union FluffData bufnode_type;
+	union FluffData handle_type;
+	/* Set if the types were made for this network by fluff_network_new_mm */
+	int own_types;
 };
 
 enum HandleType {
@@ -78,9 +85,14 @@ static void setup_mm(){
     network_size = MM->f_type_new(sizeof(struct FluffNetwork));
     bufnode_size = MM->f_type_new(sizeof(struct BufferNode));
     handle_size = MM->f_type_new(sizeof(struct FluffNetworkHandle));
+    mm_need_setup = 0;
 }
 
-#define ENSURE_MM if (mm_need_setup) setup_mm();
+static void __attribute__((constructor)) init_mm(){
+	if (mm_need_setup){
+		setup_mm();
+	}
+}
 
 void fluff_network_setmm(const struct FluffMM * mm){
 	if (!mm_need_setup){
@@ -103,7 +115,7 @@ static struct FluffNetworkHandle * handle_new(
 		struct FluffNetwork * network){
 	struct FluffNetworkHandle * self = NULL;
 	if (!fluff_traceback_grab("handle_new")){
-		if ((self = MM->f_alloc(handle_size))){
+		if ((self = network->mm->f_alloc(network->handle_type))){
 			self->sock = sock;
 			self->type = type;
 			self->network = network;
@@ -122,10 +134,11 @@ static struct FluffNetworkHandle * handle_new(
 
 static void buffer_free(
 		struct FluffNetwork * network, struct BufferNode * buffer){
-	struct BufferNode * next;
+	void * batch[FREE_BATCH];
+	size_t n;
 
+	n = 0;
 	while (buffer){
-		next = buffer->next;
 		switch (network->send_opt) {
 			case FluffNetworkSendOptCopy:
 				free(buffer->data);
@@ -136,9 +149,14 @@ static void buffer_free(
 			default:
 				break;
 		}
-		MM->f_free(buffer);
-		buffer = next;
+		batch[n++] = buffer;
+		buffer = buffer->next;
+		if (n == FREE_BATCH){
+			network->mm->f_free_batch(batch, n);
+			n = 0;
+		}
 	}
+	network->mm->f_free_batch(batch, n);
 }
 
 static void handle_free(struct FluffNetworkHandle * self){
@@ -149,7 +167,7 @@ static void handle_free(struct FluffNetworkHandle * self){
 	fluff_set_element_remove(self->network->connecting, self->element);
 	fluff_set_element_remove(self->network->handles, self->element);
 	fluff_set_element_element_free(self->element);
-	MM->f_free(self);
+	self->network->mm->f_free(self);
 }
 
 static int check_connecting(struct FluffNetwork * self){
@@ -238,29 +256,45 @@ static int attempt_send(struct FluffNetworkHandle * handle){
  * Exported Functions
  */
 
+/*
+ * Set up a network allocated from mm, freeing it on failure
+ */
+static struct FluffNetwork * network_init(
+		struct FluffNetwork * self,
+		const struct FluffMM * mm,
+		enum FluffNetworkSendOpt send_opt,
+		va_list args){
+	if (!(self->sockets = fluff_socket_set_new())){
+		fluff_traceback_set("failed to allocate set");
+		mm->f_free(self);
+		return NULL;
+	}
+	self->send_opt = send_opt;
+	if (send_opt == FluffNetworkSendOptFree){
+		self->send_freer = va_arg(args, FluffFreeFunction);
+	}
+	self->connecting = NULL;
+	self->handles = NULL;
+	self->mm = mm;
+	return self;
+}
+
 struct FluffNetwork * fluff_network_new(
 		enum FluffNetworkSendOpt send_opt, ...){
 	struct FluffNetwork * self = NULL;
 	va_list args;
 
-	ENSURE_MM;
-
 	if (!fluff_traceback_grab("fluff_network_new")){
 		if ((self = MM->f_alloc(network_size))){
-			if (!(self->sockets = fluff_socket_set_new())){
-				fluff_traceback_set("failed to allocate set");
-				MM->f_free(self);
-				return NULL;
-			}
-			self->send_opt = send_opt;
-			if (send_opt == FluffNetworkSendOptFree){
-				va_start(args, send_opt);
-				self->send_freer = va_arg(args, FluffFreeFunction);
-				va_end(args);
+			self->bufnode_type = bufnode_size;
+			self->handle_type = handle_size;
+			self->own_types = 0;
+			va_start(args, send_opt);
+			self = network_init(self, MM, send_opt, args);
+			va_end(args);
+			if (self){
+				fluff_traceback_drop();
 			}
-			self->connecting = NULL;
-			self->handles = NULL;
-			fluff_traceback_drop();
 		} else {
 			fluff_traceback_set("failed to allocate object");
 		}
@@ -268,6 +302,55 @@ struct FluffNetwork * fluff_network_new(
 	return self;
 }
 
+struct FluffNetwork * fluff_network_new_mm(
+		const struct FluffMM * mm, enum FluffNetworkSendOpt send_opt, ...){
+	struct FluffNetwork * self = NULL;
+	union FluffData bufnode_type, handle_type;
+	va_list args;
+
+	if (!fluff_traceback_grab("fluff_network_new_mm")){
+		bufnode_type = mm->f_type_new(sizeof(struct BufferNode));
+		handle_type = mm->f_type_new(sizeof(struct FluffNetworkHandle));
+		if (bufnode_type.d_ptr && handle_type.d_ptr
+				&& (self = mm->f_alloc_size(sizeof(struct FluffNetwork)))){
+			self->bufnode_type = bufnode_type;
+			self->handle_type = handle_type;
+			self->own_types = 1;
+			va_start(args, send_opt);
+			self = network_init(self, mm, send_opt, args);
+			va_end(args);
+		} else {
+			fluff_traceback_set("failed to allocate object");
+		}
+		if (self){
+			fluff_traceback_drop();
+		} else {
+			/* network_init has freed self on failure, not the types */
+			if (bufnode_type.d_ptr){
+				mm->f_type_free(bufnode_type);
+			}
+			if (handle_type.d_ptr){
+				mm->f_type_free(handle_type);
+			}
+		}
+	}
+	return self;
+}
+
+int fluff_network_reserve(
+		struct FluffNetwork * self, size_t handles, size_t buffers){
+	/* Other managers keep no cache to fill */
+	if (self->mm != fluff_mm_cache && self->mm != fluff_mm_cache_threaded
+			&& self->mm != fluff_mm_cache_compact){
+		return 0;
+	}
+	if (fluff_mm_cache_reserve(self->handle_type, handles) < handles
+			|| fluff_mm_cache_reserve(self->bufnode_type, buffers) < buffers){
+		return -1;
+	}
+	return 0;
+}
+
 int fluff_network_bind(
 		struct FluffNetwork * self,
 		struct FluffSocketAddr * addr,
@@ -448,7 +531,11 @@ void fluff_network_del(struct FluffNetwork * self){
 		handle = handle_as_data.d_ptr;
 		handle_free(handle);
 	}
-	MM->f_free(self);
+	if (self->own_types){
+		self->mm->f_type_free(self->bufnode_type);
+		self->mm->f_type_free(self->handle_type);
+	}
+	self->mm->f_free(self);
 }
 
 union FluffData fluff_network_handle_get_userdata(struct FluffNetworkHandle * self){
@@ -483,14 +570,14 @@ ssize_t fluff_network_send(
 	struct BufferNode * node;
 	void * data;
 
-	if ((node = MM->f_alloc(bufnode_size))){
+	if ((node = self->network->mm->f_alloc(self->network->bufnode_type))){
 		node->offset = 0;
 		node->size = len;
 		node->next = NULL;
 		switch (self->network->send_opt){
 			case FluffNetworkSendOptCopy:
 				if (!(node->data = data = malloc(len))){
-					MM->f_free(node);
+					self->network->mm->f_free(node);
 					return -1;
 				}
 				memcpy(data, buf, len);
@@ -57,6 +57,26 @@ enum FluffNetworkSendOpt {
  */
 struct FluffNetwork * fluff_network_new(enum FluffNetworkSendOpt, ...);
 
+/*
+ * Create a new network instance whose handles and buffers are allocated by
+ * the given memory manager instead of the module's
+ * Returns new network on success, NULL on failure
+ */
+struct FluffNetwork * fluff_network_new_mm(
+		const struct FluffMM *, enum FluffNetworkSendOpt, ...);
+
+/*
+ * Prefill the cache of the network's memory manager with room for a number
+ * of handles and of buffered sends, so the first connections are not slowed
+ * by the underlying allocator. The sockets of connections come from the
+ * socket module and are not covered.
+ * Does nothing and returns 0 unless the network's manager is one of the
+ * caching managers
+ * Return 0 on success, -1 on failure
+ */
+int fluff_network_reserve(
+		struct FluffNetwork *, size_t handles, size_t buffers);
+
 /*
  * Bind to a service and start accepting connections
  * The callback will be called when a once each time a client connects
@@ -136,4 +156,9 @@ long int fluff_network_send(
  */
 void fluff_network_disconnect(struct FluffNetworkHandle *);
 
+/*
+ * Set the memory manager used by this module
+ */
+void fluff_network_setmm(const struct FluffMM *);
+
 #endif /* FLUFF_NETWORK_H_ */
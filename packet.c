@@ -52,7 +52,11 @@ static void setup_mm(){
     mm_need_setup = 0;
 }
 
-#define ENSURE_MM if (mm_need_setup) setup_mm();
+static void __attribute__((constructor)) init_mm(){
+	if (mm_need_setup){
+		setup_mm();
+	}
+}
 
 /*
  * Create a new packet definition collection
@@ -62,8 +66,6 @@ struct FluffPacketDefinition * fluff_packet_definition_new(){
 	struct FluffPacketDefinition * self;
 	int i;
 
-	ENSURE_MM;
-
 	if ((self = MM->f_alloc(def_size))){
 		for (i = 0; i < 256; ++i){
 			self->packets[i].definition = self;
@@ -45,7 +45,11 @@ static void setup_mm(){
     mm_need_setup = 0;
 }
 
-#define ENSURE_MM if (mm_need_setup) setup_mm();
+static void __attribute__((constructor)) init_mm(){
+	if (mm_need_setup){
+		setup_mm();
+	}
+}
 
 void fluff_random_setmm(const struct FluffMM * mm){
 	if (!mm_need_setup){
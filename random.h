@@ -20,6 +20,7 @@
 #define FLUFF_RANDOM_H_
 
 #include "data.h"
+#include "mm.h"
 
 /*
  * Random object
@@ -72,4 +73,9 @@ void fluff_random_shuffle(
  */
 void fluff_random_del(struct FluffRandom *);
 
+/*
+ * Set the memory manager used by this module
+ */
+void fluff_random_setmm(const struct FluffMM *);
+
 #endif /* FLUFF_RANDOM_H_ */
@@ -17,35 +17,81 @@
 */
 
 #include "set.h"
+#include "bitwords.h"
 
 #include <limits.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define TABLE_START 16
 #define ENLARGE .75
 #define SHRINK .25
+#define COUNT_SHARDS 16
 
 /*
  * Set types
  */
 struct FluffSetEnum {
-	int max;
-	int count;
-	char * bits;
+	unsigned int max;
+	unsigned int count;
+	unsigned int n_words;
+	uint64_t * words;
+	/* Counts of an atomic enum set, NULL for other enum sets */
+	struct EnumCountShard * shards;
+};
+
+/*
+ * Share of the count of an atomic enum set changed by some threads
+ * May go below 0 when a value added by one thread is removed by another
+ */
+struct EnumCountShard {
+	long count;
+	char pad[FLUFF_MM_CACHE_LINE - sizeof(long)];
+};
+
+struct FluffSetEnumIter {
+	struct FluffSetEnum * set;
+	unsigned int index;
+	/* Members of words[index] not yet returned */
+	uint64_t word;
+};
+
+struct HashTable {
+	/* One control byte per slot, followed by the slots, in one block */
+	int8_t * ctrl;
+	struct HashSlot * slots;
+	size_t size;
+	size_t count;
+	/* Slots which held a removed value, see CTRL_DELETED */
+	size_t deleted;
 };
 
 struct FluffSetHash {
 	FluffEqualFunction equal;
 	FluffHashFunction hash;
-	int count;
-	size_t tablesize;
-	struct HashElement ** table;
+	struct HashTable table;
+	/* Table being moved into table, of size 0 when there is none */
+	struct HashTable old;
+	/* Slots of old moved so far */
+	size_t moved;
+	/* Slots of old moved by each operation, 0 to move them all at once */
+	size_t rehash_budget;
+	/* Size the table is not shrunk below, set by fluff_set_hash_reserve */
+	size_t min_size;
+	const struct FluffMM * mm;
 };
 
-struct HashElement {
+struct HashSlot {
 	FluffHashValue hash;
 	union FluffData data;
-	struct HashElement * next;
+};
+
+struct FluffSetHashIter {
+	struct FluffSetHash * set;
+	size_t index;
 };
 
 struct FluffSetElement {
@@ -75,8 +121,10 @@ static int mm_need_setup = 1;
 static const struct FluffMM * MM = NULL;
 
 static union FluffData setenum_size;
+static union FluffData enumiter_size;
+static union FluffData shards_size;
 static union FluffData sethash_size;
-static union FluffData hashel_size;
+static union FluffData hashiter_size;
 static union FluffData setelement_size;
 static union FluffData element_size;
 static union FluffData iter_size;
@@ -86,21 +134,30 @@ static void setup_mm(){
 		MM = fluff_mm_default;
 	}
     setenum_size = MM->f_type_new(sizeof(struct FluffSetEnum));
+    enumiter_size = MM->f_type_new(sizeof(struct FluffSetEnumIter));
+    shards_size = MM->f_type_new_aligned(
+    		COUNT_SHARDS * sizeof(struct EnumCountShard), FLUFF_MM_CACHE_LINE);
     sethash_size = MM->f_type_new(sizeof(struct FluffSetHash));
-    hashel_size = MM->f_type_new(sizeof(struct HashElement));
+    hashiter_size = MM->f_type_new(sizeof(struct FluffSetHashIter));
     setelement_size = MM->f_type_new(sizeof(struct FluffSetElement));
     element_size = MM->f_type_new(sizeof(struct FluffSetElementElement));
     iter_size = MM->f_type_new(sizeof(struct FluffSetElementIter));
-
+    mm_need_setup = 0;
 }
 
-#define ENSURE_MM if (mm_need_setup) setup_mm();
+static void __attribute__((constructor)) init_mm(){
+	if (mm_need_setup){
+		setup_mm();
+	}
+}
 
 void fluff_set_setmm(const struct FluffMM * mm){
 	if (!mm_need_setup){
 		MM->f_type_free(setenum_size);
+		MM->f_type_free(enumiter_size);
+		MM->f_type_free(shards_size);
 		MM->f_type_free(sethash_size);
-		MM->f_type_free(hashel_size);
+		MM->f_type_free(hashiter_size);
 		MM->f_type_free(setelement_size);
 		MM->f_type_free(element_size);
 		MM->f_type_free(iter_size);
@@ -112,227 +169,1044 @@ void fluff_set_setmm(const struct FluffMM * mm){
 
 /*
  * Enum Set
+ * Values are bits of an array of 64 bit words, value n being bit n % 64 of
+ * word n / 64. Bits at or above max in the last word are always clear
  */
-struct FluffSetEnum * fluff_set_enum_new(unsigned int max){
-	struct FluffSetEnum * self;
-	unsigned int n_bytes;
 
-	ENSURE_MM;
+#define WORD_BITS 64
+#define WORD_INDEX(n) ((n) / WORD_BITS)
+#define WORD_BIT(n) ((uint64_t)1 << ((n) % WORD_BITS))
+
+/*
+ * Read a word of a set which may be changed by other threads meanwhile
+ */
+#define WORD_LOAD(set, i) __atomic_load_n((set)->words + (i), __ATOMIC_RELAXED)
+
+/* Gives each thread its own count shard, 0 until the thread needs one */
+static __thread unsigned int shard_index = 0;
+static unsigned int shard_next = 0;
+
+static void set_enum_shard_add(struct FluffSetEnum * self, long n){
+	if (!shard_index){
+		shard_index = __atomic_add_fetch(&shard_next, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch(&self->shards[shard_index % COUNT_SHARDS].count, n,
+			__ATOMIC_RELAXED);
+}
+
+/*
+ * Set the count after a change to the whole set
+ */
+static void set_enum_store_count(struct FluffSetEnum * self, size_t count){
+	int i;
 
-	n_bytes = (max + CHAR_BIT - 1) / CHAR_BIT;
+	if (self->shards){
+		self->shards[0].count = count;
+		for (i = 1; i < COUNT_SHARDS; ++i){
+			self->shards[i].count = 0;
+		}
+	} else {
+		self->count = count;
+	}
+}
+
+typedef size_t (*BitWordsOp)(uint64_t * dest,
+		const uint64_t * a, const uint64_t * b, size_t n);
+
+/*
+ * Create an enum set whose words are left uninitialized
+ */
+static struct FluffSetEnum * set_enum_alloc(unsigned int max){
+	struct FluffSetEnum * self;
+	unsigned int n_words;
+
+	n_words = (max + WORD_BITS - 1) / WORD_BITS;
 	if ((self = MM->f_alloc(setenum_size))){
-		if (!(self->bits = MM->f_alloc_size(n_bytes))){
+		if (!(self->words = MM->f_alloc_size(n_words * sizeof(uint64_t)))){
 			MM->f_free(self);
 			self = NULL;
 		} else {
-			memset(self->bits, 0, n_bytes);
 			self->max = max;
 			self->count = 0;
+			self->n_words = n_words;
+			self->shards = NULL;
+		}
+	}
+	return self;
+}
+
+struct FluffSetEnum * fluff_set_enum_new(unsigned int max){
+	struct FluffSetEnum * self;
+
+	if ((self = set_enum_alloc(max))){
+		memset(self->words, 0, self->n_words * sizeof(uint64_t));
+	}
+	return self;
+}
+
+struct FluffSetEnum * fluff_set_enum_new_atomic(unsigned int max){
+	struct FluffSetEnum * self;
+
+	if ((self = fluff_set_enum_new(max))){
+		if (!(self->shards = MM->f_alloc(shards_size))){
+			fluff_set_enum_free(self);
+			return NULL;
 		}
+		memset(self->shards, 0, COUNT_SHARDS * sizeof(struct EnumCountShard));
 	}
 	return self;
 }
 
 void fluff_set_enum_free(struct FluffSetEnum * self){
-	MM->f_free(self->bits);
+	if (self->shards){
+		MM->f_free(self->shards);
+	}
+	MM->f_free(self->words);
 	MM->f_free(self);
 }
 
 unsigned int fluff_set_enum_count(struct FluffSetEnum * self){
-	return self->count;
-}
+	long count;
+	int i;
 
-static inline int set_enum_contains_base(
-		struct FluffSetEnum * self, unsigned int block, unsigned int n){
-	return self->bits[block] & (1 << n);
+	if (!self->shards){
+		return self->count;
+	}
+	count = 0;
+	for (i = 0; i < COUNT_SHARDS; ++i){
+		count += __atomic_load_n(&self->shards[i].count, __ATOMIC_RELAXED);
+	}
+	/* Shards read while values move between them may not add up */
+	if (count < 0){
+		return 0;
+	}
+	return count > self->max ? self->max : count;
 }
 
-void fluff_set_enum_add(struct FluffSetEnum * self, unsigned int n){
-	unsigned int block;
+int fluff_set_enum_test_and_set(struct FluffSetEnum * self, unsigned int n){
+	uint64_t * word, old;
 
-	block = (n / CHAR_BIT);
-	n %= CHAR_BIT;
-	if (!set_enum_contains_base(self, block, n)){
+	word = self->words + WORD_INDEX(n);
+	if (self->shards){
+		old = __atomic_fetch_or(word, WORD_BIT(n), __ATOMIC_ACQ_REL);
+		if (!(old & WORD_BIT(n))){
+			set_enum_shard_add(self, 1);
+		}
+	} else if (!((old = *word) & WORD_BIT(n))){
 		self->count += 1;
-		self->bits[block] |= (1 << n);
+		*word = old | WORD_BIT(n);
 	}
+	return (old & WORD_BIT(n)) != 0;
 }
 
-int fluff_set_enum_contains(struct FluffSetEnum * self, unsigned int n){
-	unsigned int block;
+int fluff_set_enum_test_and_clear(struct FluffSetEnum * self, unsigned int n){
+	uint64_t * word, old;
+
+	word = self->words + WORD_INDEX(n);
+	if (self->shards){
+		old = __atomic_fetch_and(word, ~WORD_BIT(n), __ATOMIC_ACQ_REL);
+		if (old & WORD_BIT(n)){
+			set_enum_shard_add(self, -1);
+		}
+	} else if ((old = *word) & WORD_BIT(n)){
+		self->count -= 1;
+		*word = old & ~WORD_BIT(n);
+	}
+	return (old & WORD_BIT(n)) != 0;
+}
+
+void fluff_set_enum_add(struct FluffSetEnum * self, unsigned int n){
+	fluff_set_enum_test_and_set(self, n);
+}
 
-	block = (n / CHAR_BIT);
-	n %= CHAR_BIT;
-	return set_enum_contains_base(self, block, n);
+int fluff_set_enum_contains(struct FluffSetEnum * self, unsigned int n){
+	return (__atomic_load_n(self->words + WORD_INDEX(n), __ATOMIC_ACQUIRE)
+			& WORD_BIT(n)) != 0;
 }
 
 void fluff_set_enum_remove(struct FluffSetEnum * self, unsigned int n){
-	unsigned int block;
+	fluff_set_enum_test_and_clear(self, n);
+}
 
-	block = (n / CHAR_BIT);
-	n %= CHAR_BIT;
-	if (set_enum_contains_base(self, block, n)){
-		self->count -= 1;
-		self->bits[block] ^= (1 << n);
+/*
+ * Find the first member in words at or after index, whose bits below the
+ * first wanted value have already been masked off in word
+ */
+static unsigned int set_enum_scan(
+		struct FluffSetEnum * self, unsigned int index, uint64_t word){
+	while (!word){
+		if (++index >= self->n_words){
+			return self->max;
+		}
+		word = WORD_LOAD(self, index);
+	}
+	return index * WORD_BITS + __builtin_ctzll(word);
+}
+
+unsigned int fluff_set_enum_find_first(struct FluffSetEnum * self){
+	if (!self->n_words){
+		return self->max;
+	}
+	return set_enum_scan(self, 0, WORD_LOAD(self, 0));
+}
+
+unsigned int fluff_set_enum_find_next(
+		struct FluffSetEnum * self, unsigned int n){
+	unsigned int index;
+
+	if (++n >= self->max){
+		return self->max;
+	}
+	index = WORD_INDEX(n);
+	return set_enum_scan(
+			self, index, WORD_LOAD(self, index) & ~(WORD_BIT(n) - 1));
+}
+
+unsigned int fluff_set_enum_rank(struct FluffSetEnum * self, unsigned int n){
+	return fluff_set_enum_count_range(self, 0, n);
+}
+
+unsigned int fluff_set_enum_count_range(
+		struct FluffSetEnum * self, unsigned int start, unsigned int stop){
+	unsigned int first, last, count, i;
+
+	if (stop > self->max){
+		stop = self->max;
+	}
+	if (start >= stop){
+		return 0;
+	}
+	first = WORD_INDEX(start);
+	last = WORD_INDEX(stop - 1);
+	if (first == last){
+		return __builtin_popcountll(WORD_LOAD(self, first)
+				& ~(WORD_BIT(start) - 1) & (WORD_BIT(stop - 1) * 2 - 1));
+	}
+	count = __builtin_popcountll(
+			WORD_LOAD(self, first) & ~(WORD_BIT(start) - 1));
+	if (self->shards){
+		for (i = first + 1; i < last; ++i){
+			count += __builtin_popcountll(WORD_LOAD(self, i));
+		}
+	} else {
+		count += fluff_bitwords->f_popcount(
+				self->words + first + 1, last - first - 1);
+	}
+	return count + __builtin_popcountll(
+			WORD_LOAD(self, last) & (WORD_BIT(stop - 1) * 2 - 1));
+}
+
+unsigned int fluff_set_enum_select(struct FluffSetEnum * self, unsigned int k){
+	unsigned int index, pop;
+	uint64_t word;
+
+	if (!self->shards && k >= self->count){
+		return self->max;
+	}
+	for (index = 0; ; ++index){
+		if (index >= self->n_words){
+			return self->max;
+		}
+		word = WORD_LOAD(self, index);
+		if (k < (pop = __builtin_popcountll(word))){
+			break;
+		}
+		k -= pop;
+	}
+	while (k--){
+		word &= word - 1;
+	}
+	return index * WORD_BITS + __builtin_ctzll(word);
+}
+
+struct FluffSetEnumIter * fluff_set_enum_iter(struct FluffSetEnum * set){
+	struct FluffSetEnumIter * self;
+
+	if ((self = MM->f_alloc(enumiter_size))){
+		self->set = set;
+		self->index = 0;
+		self->word = set->n_words ? WORD_LOAD(set, 0) : 0;
+	}
+	return self;
+}
+
+void fluff_set_enum_iter_free(struct FluffSetEnumIter * self){
+	MM->f_free(self);
+}
+
+int fluff_set_enum_iter_next(
+		struct FluffSetEnumIter * self, unsigned int * dest){
+	while (!self->word){
+		if (++self->index >= self->set->n_words){
+			self->index = self->set->n_words;
+			return 0;
+		}
+		self->word = WORD_LOAD(self->set, self->index);
+	}
+	if (dest){
+		*dest = self->index * WORD_BITS + __builtin_ctzll(self->word);
+	}
+	self->word &= self->word - 1;
+	return 1;
+}
+
+/*
+ * Apply an operation to self and other in place
+ * keep_rest tells whether words of self past the end of other are kept, as
+ * if other's missing words were 0, or cleared
+ */
+static void set_enum_apply(struct FluffSetEnum * self,
+		struct FluffSetEnum * other, BitWordsOp op, int keep_rest){
+	unsigned int n;
+	size_t count;
+	uint64_t extra;
+
+	n = self->n_words < other->n_words ? self->n_words : other->n_words;
+	count = op(self->words, self->words, other->words, n);
+	if (n < self->n_words){
+		if (keep_rest){
+			count += fluff_bitwords->f_popcount(
+					self->words + n, self->n_words - n);
+		} else {
+			memset(self->words + n, 0, (self->n_words - n) * sizeof(uint64_t));
+		}
+	} else if (n && self->max % WORD_BITS){
+		/* other may have values in the last word which are too big */
+		extra = self->words[n - 1] & ~(WORD_BIT(self->max) - 1);
+		if (extra){
+			count -= __builtin_popcountll(extra);
+			self->words[n - 1] &= ~extra;
+		}
+	}
+	set_enum_store_count(self, count);
+}
+
+/*
+ * Create a set of the given max from an operation on a and b
+ * keep_a and keep_b tell whether words of a or b past the end of the other
+ * are copied, as if the other's missing words were 0. max must not cut off
+ * values the operation keeps
+ */
+static struct FluffSetEnum * set_enum_apply_new(struct FluffSetEnum * a,
+		struct FluffSetEnum * b, unsigned int max, BitWordsOp op,
+		int keep_a, int keep_b){
+	struct FluffSetEnum * self, * longer;
+	unsigned int n;
+	size_t count;
+
+	if (!(self = set_enum_alloc(max))){
+		return NULL;
+	}
+	n = a->n_words < b->n_words ? a->n_words : b->n_words;
+	if (n > self->n_words){
+		n = self->n_words;
+	}
+	count = op(self->words, a->words, b->words, n);
+	if (n < self->n_words){
+		longer = a->n_words > n ? a : b;
+		if (longer == a ? keep_a : keep_b){
+			memcpy(self->words + n, longer->words + n,
+					(self->n_words - n) * sizeof(uint64_t));
+			count += fluff_bitwords->f_popcount(
+					self->words + n, self->n_words - n);
+		} else {
+			memset(self->words + n, 0,
+					(self->n_words - n) * sizeof(uint64_t));
+		}
+	}
+	self->count = count;
+	return self;
+}
+
+#define MAX_OF(a, b) ((a)->max > (b)->max ? (a)->max : (b)->max)
+#define MIN_OF(a, b) ((a)->max < (b)->max ? (a)->max : (b)->max)
+
+void fluff_set_enum_union(
+		struct FluffSetEnum * self, struct FluffSetEnum * other){
+	set_enum_apply(self, other, fluff_bitwords->f_or, 1);
+}
+
+void fluff_set_enum_intersection(
+		struct FluffSetEnum * self, struct FluffSetEnum * other){
+	set_enum_apply(self, other, fluff_bitwords->f_and, 0);
+}
+
+void fluff_set_enum_difference(
+		struct FluffSetEnum * self, struct FluffSetEnum * other){
+	set_enum_apply(self, other, fluff_bitwords->f_andnot, 1);
+}
+
+void fluff_set_enum_symmetric_difference(
+		struct FluffSetEnum * self, struct FluffSetEnum * other){
+	set_enum_apply(self, other, fluff_bitwords->f_xor, 1);
+}
+
+struct FluffSetEnum * fluff_set_enum_union_new(
+		struct FluffSetEnum * a, struct FluffSetEnum * b){
+	return set_enum_apply_new(a, b, MAX_OF(a, b), fluff_bitwords->f_or, 1, 1);
+}
+
+struct FluffSetEnum * fluff_set_enum_intersection_new(
+		struct FluffSetEnum * a, struct FluffSetEnum * b){
+	return set_enum_apply_new(a, b, MIN_OF(a, b), fluff_bitwords->f_and, 0, 0);
+}
+
+struct FluffSetEnum * fluff_set_enum_difference_new(
+		struct FluffSetEnum * a, struct FluffSetEnum * b){
+	return set_enum_apply_new(a, b, a->max, fluff_bitwords->f_andnot, 1, 0);
+}
+
+struct FluffSetEnum * fluff_set_enum_symmetric_difference_new(
+		struct FluffSetEnum * a, struct FluffSetEnum * b){
+	return set_enum_apply_new(a, b, MAX_OF(a, b), fluff_bitwords->f_xor, 1, 1);
+}
+
+int fluff_set_enum_subset(struct FluffSetEnum * a, struct FluffSetEnum * b){
+	if (!a->shards && !b->shards && a->count > b->count){
+		return 0;
+	}
+	if (a->n_words > b->n_words){
+		if (fluff_bitwords->f_popcount(
+				a->words + b->n_words, a->n_words - b->n_words)){
+			return 0;
+		}
+		return fluff_bitwords->f_subset(a->words, b->words, b->n_words);
 	}
+	return fluff_bitwords->f_subset(a->words, b->words, a->n_words);
+}
 
+int fluff_set_enum_disjoint(struct FluffSetEnum * a, struct FluffSetEnum * b){
+	return fluff_bitwords->f_disjoint(a->words, b->words,
+			a->n_words < b->n_words ? a->n_words : b->n_words);
 }
 
 /*
  * Hash Set
+ * Values are stored with their hash in a flat table of slots, probed in
+ * groups of GROUP_SIZE. Each slot has a control byte, which is CTRL_EMPTY,
+ * CTRL_DELETED or the top 7 bits of the hash of the value in the slot, so a
+ * group is searched by comparing its control bytes at once, and slots are
+ * only looked at when their byte matches. Hashes are mixed before use, see
+ * set_hash_of, and tables are a power of two in size, so a hash's group is
+ * picked from its low bits with a mask. The group index starts at bit 0, so
+ * it stays clear of the control byte's bits in tables up to 2^29 slots.
+ * Larger tables need more bits than the hash has.
+ * A lookup visits groups from the one holding the hash's slot, moving 1, 2,
+ * 3... groups further each time, until it finds the value or a group with
+ * an empty slot. A group which has an empty slot has never been full since
+ * the table was built, so no value was placed past it, and a removed value's
+ * slot may be made empty again.
+ */
+
+#define GROUP_SIZE 16
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+#define CTRL_HASH(hash) ((int8_t)((hash) >> 25))
+
+#ifdef __SSE2__
+
+/*
+ * Return a mask of the slots in a group whose control byte is ctrl
+ */
+static inline unsigned int group_match(const int8_t * group, int8_t ctrl){
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *)group), _mm_set1_epi8(ctrl)));
+}
+
+/*
+ * Return a mask of the slots in a group which are empty or deleted
  */
+static inline unsigned int group_match_free(const int8_t * group){
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+}
+
+#else
+
+static inline unsigned int group_match(const int8_t * group, int8_t ctrl){
+	unsigned int mask, i;
+
+	mask = 0;
+	for (i = 0; i < GROUP_SIZE; ++i){
+		mask |= (unsigned int)(group[i] == ctrl) << i;
+	}
+	return mask;
+}
+
+static inline unsigned int group_match_free(const int8_t * group){
+	unsigned int mask, i;
+
+	mask = 0;
+	for (i = 0; i < GROUP_SIZE; ++i){
+		mask |= (unsigned int)(group[i] < 0) << i;
+	}
+	return mask;
+}
+
+#endif /* __SSE2__ */
+
+#ifdef FLUFF_SET_HASH_MODULO
+
+/*
+ * For bench/set_bench.c, which includes this file: while set_hash_modulo is
+ * set, hashes are used unmixed and groups are picked with hash % size, as
+ * before tables were known to be a power of two in size. It must not change
+ * while a set is in use
+ */
+static int set_hash_modulo = 0;
+
+#define GROUP_START(table, hash) (set_hash_modulo \
+	? ((hash) % (table)->size) & ~(size_t)(GROUP_SIZE - 1) \
+	: ((size_t)(hash) * GROUP_SIZE) & ((table)->size - 1))
+
+#else
+
+#define GROUP_START(table, hash) \
+	(((size_t)(hash) * GROUP_SIZE) & ((table)->size - 1))
+
+#endif /* FLUFF_SET_HASH_MODULO */
+
+/*
+ * Hash a value for the set
+ * Hash functions such as fluff_hash_str, or ones returning an address, may
+ * leave the low bits which pick a group or the high bits which make the
+ * control byte nearly constant, so every bit of the hash is spread over the
+ * others with the finalizer of MurmurHash3. Being invertible, it keeps
+ * distinct hashes distinct
+ */
+static inline FluffHashValue set_hash_of(
+		struct FluffSetHash * self, union FluffData data){
+	FluffHashValue hash;
+
+	hash = self->hash(data);
+#ifdef FLUFF_SET_HASH_MODULO
+	if (set_hash_modulo){
+		return hash;
+	}
+#endif
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+/*
+ * Allocate a table of size slots, all empty
+ */
+static int table_new(
+		struct HashTable * table, const struct FluffMM * mm, size_t size){
+	int8_t * ctrl;
+
+	if (!(ctrl = mm->f_alloc_size(size * (1 + sizeof(struct HashSlot))))){
+		return -1;
+	}
+	memset(ctrl, CTRL_EMPTY, size);
+	table->ctrl = ctrl;
+	table->slots = (struct HashSlot *)(ctrl + size);
+	table->size = size;
+	table->count = 0;
+	table->deleted = 0;
+	return 0;
+}
+
+/*
+ * Find the slot of a table holding a value
+ * Return the slot's index, or the table's size if it is not there
+ */
+static size_t table_find(struct HashTable * table,
+		FluffEqualFunction equal, FluffHashValue hash, union FluffData data){
+	size_t pos, step, i;
+	unsigned int match;
+
+	pos = GROUP_START(table, hash);
+	for (step = GROUP_SIZE; ; step += GROUP_SIZE){
+		match = group_match(table->ctrl + pos, CTRL_HASH(hash));
+		for (; match; match &= match - 1){
+			i = pos + __builtin_ctz(match);
+			if (table->slots[i].hash == hash
+					&& equal(table->slots[i].data, data)){
+				return i;
+			}
+		}
+		if (group_match(table->ctrl + pos, CTRL_EMPTY)){
+			return table->size;
+		}
+		pos = (pos + step) & (table->size - 1);
+	}
+}
+
+/*
+ * Put a value which is not in the table into the first empty or deleted
+ * slot on the path of its hash
+ */
+static void table_insert(struct HashTable * table,
+		FluffHashValue hash, union FluffData data){
+	size_t pos, step;
+	unsigned int match;
+
+	pos = GROUP_START(table, hash);
+	for (step = GROUP_SIZE; ; step += GROUP_SIZE){
+		if ((match = group_match_free(table->ctrl + pos))){
+			break;
+		}
+		pos = (pos + step) & (table->size - 1);
+	}
+	pos += __builtin_ctz(match);
+	if (table->ctrl[pos] == CTRL_DELETED){
+		table->deleted -= 1;
+	}
+	table->ctrl[pos] = CTRL_HASH(hash);
+	table->slots[pos].hash = hash;
+	table->slots[pos].data = data;
+	table->count += 1;
+}
+
+static void table_erase(struct HashTable * table, size_t i){
+	if (group_match(table->ctrl + (i & ~(size_t)(GROUP_SIZE - 1)),
+			CTRL_EMPTY)){
+		table->ctrl[i] = CTRL_EMPTY;
+	} else {
+		table->ctrl[i] = CTRL_DELETED;
+		table->deleted += 1;
+	}
+	table->count -= 1;
+}
+
+/*
+ * Move values from the old table, budget slots rounded up to whole groups
+ * Return 1 if values are left to move, 0 otherwise
+ */
+static int set_hash_move(struct FluffSetHash * self, size_t budget){
+	struct HashTable * old;
+	size_t end;
+
+	old = &self->old;
+	if (!old->size){
+		return 0;
+	}
+	end = old->size - self->moved > budget
+			? self->moved + budget : old->size;
+	for (; self->moved < end || self->moved % GROUP_SIZE; ++self->moved){
+		if (old->ctrl[self->moved] >= 0){
+			table_insert(&self->table, old->slots[self->moved].hash,
+					old->slots[self->moved].data);
+			/* Deleted rather than empty, so lookups in old go past it */
+			old->ctrl[self->moved] = CTRL_DELETED;
+			old->count -= 1;
+		}
+	}
+	if (self->moved < old->size){
+		return 1;
+	}
+	self->mm->f_free(old->ctrl);
+	old->size = 0;
+	return 0;
+}
+
+/*
+ * Move every value into a new table of size slots
+ * With a rehash budget, the values are moved a few at a time by later
+ * operations. On failure the set keeps its table
+ */
+static int set_hash_resize(struct FluffSetHash * self, size_t size){
+	struct HashTable table;
+
+	set_hash_move(self, self->old.size);
+	if (table_new(&table, self->mm, size)){
+		return -1;
+	}
+	self->old = self->table;
+	self->table = table;
+	self->moved = 0;
+	if (!self->rehash_budget){
+		set_hash_move(self, self->old.size);
+	}
+	return 0;
+}
+
+/*
+ * Return the size of a table which holds n values without growing
+ */
+static size_t set_hash_size_for(size_t n){
+	size_t size;
+
+	for (size = TABLE_START; n > size * ENLARGE; size *= 2);
+	return size;
+}
+
+/*
+ * Find a value in either table
+ * Return the slot, setting table to the table holding it, or NULL
+ */
+static struct HashSlot * set_hash_find(struct FluffSetHash * self,
+		FluffHashValue hash, union FluffData data,
+		struct HashTable ** table, size_t * index){
+	size_t i;
+
+	if ((i = table_find(&self->table, self->equal, hash, data))
+			!= self->table.size){
+		*table = &self->table;
+	} else if (self->old.size && (i = table_find(
+			&self->old, self->equal, hash, data)) != self->old.size){
+		*table = &self->old;
+	} else {
+		return NULL;
+	}
+	*index = i;
+	return (*table)->slots + i;
+}
+
+/*
+ * Do an operation's share of an incremental rehash
+ */
+#define SET_HASH_STEP(self) \
+	do { \
+		if ((self)->old.size){ \
+			set_hash_move((self), (self)->rehash_budget); \
+		} \
+	} while (0)
+
+/*
+ * Set up a hash set allocated from mm, freeing it on failure
+ */
+static struct FluffSetHash * set_hash_init(
+		struct FluffSetHash * self,
+		const struct FluffMM * mm,
+		FluffHashFunction hash,
+		FluffEqualFunction equal){
+	self->mm = mm;
+	if (table_new(&self->table, mm, TABLE_START)){
+		mm->f_free(self);
+		return NULL;
+	}
+	self->old.size = 0;
+	self->old.count = 0;
+	self->moved = 0;
+	self->rehash_budget = 0;
+	self->min_size = TABLE_START;
+	self->equal = equal;
+	self->hash = hash;
+	return self;
+}
 
 struct FluffSetHash * fluff_set_hash_new(
 		FluffHashFunction hash, FluffEqualFunction equal){
 	struct FluffSetHash * self;
-	struct HashElement ** table;
-
-	ENSURE_MM;
 
 	if ((self = MM->f_alloc(sethash_size))){
-		table = MM->f_alloc_size(TABLE_START * sizeof(struct HashElement *));
-		if (!table){
-			MM->f_free(self);
-			self = NULL;
-		} else {
-			memset(table, 0, TABLE_START * sizeof(struct HashElement *));
-			self->table = table;
-			self->tablesize = TABLE_START;
-			self->count = 0;
-			self->equal = equal;
-			self->hash = hash;
-		}
+		self = set_hash_init(self, MM, hash, equal);
 	}
 	return self;
 }
 
-void fluff_set_hash_free(struct FluffSetHash * self, FluffFreeFunction freer){
-	int i;
-	struct HashElement * node, * to_del;
-
-	for (i = 0; i < self->tablesize; ++i){
-		while (node){
-			to_del = node;
-			node = node->next;
-			if (freer){
-				freer(to_del->data.d_ptr);
+struct FluffSetHash * fluff_set_hash_new_mm(
+		FluffHashFunction hash,
+		FluffEqualFunction equal,
+		const struct FluffMM * mm){
+	struct FluffSetHash * self;
+
+	if ((self = mm->f_alloc_size(sizeof(struct FluffSetHash)))){
+		self = set_hash_init(self, mm, hash, equal);
+	}
+	return self;
+}
+
+static void table_free(struct HashTable * table,
+		const struct FluffMM * mm, FluffFreeFunction freer){
+	size_t i;
+
+	if (freer){
+		for (i = 0; i < table->size; ++i){
+			if (table->ctrl[i] >= 0){
+				freer(table->slots[i].data.d_ptr);
 			}
-			MM->f_free(to_del);
 		}
 	}
+	mm->f_free(table->ctrl);
+}
+
+void fluff_set_hash_free(struct FluffSetHash * self, FluffFreeFunction freer){
+	table_free(&self->table, self->mm, freer);
+	if (self->old.size){
+		table_free(&self->old, self->mm, freer);
+	}
+	self->mm->f_free(self);
 }
 
 unsigned int fluff_set_hash_count(struct FluffSetHash * self){
-	return self->count;
+	return self->table.count + self->old.count;
 }
 
-void fluff_set_hash_add(struct FluffSetHash * self, union FluffData data){
-	FluffHashValue hash;
-	struct HashElement ** dest;
-	struct HashElement * node, * node2;
-	struct HashElement ** new_table;
-	size_t new_tablesize;
-	int i;
+void fluff_set_hash_set_rehash_budget(
+		struct FluffSetHash * self, size_t budget){
+	self->rehash_budget = budget;
+	if (!budget){
+		set_hash_move(self, self->old.size);
+	}
+}
 
-	hash = self->hash(data);
-	dest = self->table + (hash % self->tablesize);
-	while ((node = *dest)){
-		if (node->hash == hash && self->equal(node->data, data)){
+int fluff_set_hash_rehash_step(struct FluffSetHash * self, size_t budget){
+	return set_hash_move(self, budget);
+}
+
+int fluff_set_hash_reserve(struct FluffSetHash * self, size_t n){
+	size_t size;
+
+	size = set_hash_size_for(n);
+	if (size > self->min_size){
+		self->min_size = size;
+	}
+	if (size <= self->table.size){
+		return 0;
+	}
+	return set_hash_resize(self, size);
+}
+
+int fluff_set_hash_shrink_to_fit(struct FluffSetHash * self){
+	size_t size;
+
+	set_hash_move(self, self->old.size);
+	self->min_size = TABLE_START;
+	size = set_hash_size_for(self->table.count);
+	if (size == self->table.size && !self->table.deleted){
+		return 0;
+	}
+	/* The new table may be too small to take adds while values move */
+	if (set_hash_resize(self, size)){
+		return -1;
+	}
+	set_hash_move(self, self->old.size);
+	return 0;
+}
+
+/*
+ * Add a value to the set, given its hash from set_hash_of
+ */
+static void set_hash_add_hashed(struct FluffSetHash * self,
+		FluffHashValue hash, union FluffData data){
+	struct HashTable * table;
+	size_t i, count;
+
+	if (set_hash_find(self, hash, data, &table, &i)){
+		return;
+	}
+	table = &self->table;
+	if (table->count + table->deleted + 1 > table->size * ENLARGE){
+		/* A resize while one is under way finishes it first */
+		set_hash_move(self, self->old.size);
+		count = table->count + 1;
+		/* Clearing out deleted slots may be enough */
+		if (count + table->deleted > table->size * ENLARGE
+				&& set_hash_resize(self, count > table->size / 2
+						? table->size * 2 : table->size)
+				&& count + table->deleted + 1 > table->size){
+			/* Keep an empty slot, which ends every lookup */
 			return;
 		}
-		dest = &(node->next);
-	}
-	self->count += 1;
-	if (self->count * ENLARGE > self->tablesize){
-		new_tablesize = self->tablesize * 2;
-		new_table = MM->f_alloc_size(
-				new_tablesize * sizeof(struct HashElement *));
-		if (new_table){
-			memset(new_table, 0, new_tablesize * sizeof(struct HashElement *));
-			for (i = 0; i < self->tablesize; ++i){
-				node = self->table[i];
-				while (node){
-					node2 = node->next;
-					dest = new_table + (node->hash % new_tablesize);
-					node->next = *dest;
-					*dest = node;
-					node = node2;
-				}
-			}
-			MM->f_free(self->table);
-			self->table = new_table;
-			self->tablesize = new_tablesize;
-			dest = new_table + (hash % new_tablesize);
-			while ((node = *dest)){
-				dest = &(node->next);
-			}
-		}
-	}
-	if ((node = MM->f_alloc(hashel_size))){
-		node->data = data;
-		node->hash = hash;
-		node->next = NULL;
-		*dest = node;
 	}
+	table_insert(&self->table, hash, data);
+}
+
+void fluff_set_hash_add(struct FluffSetHash * self, union FluffData data){
+	SET_HASH_STEP(self);
+	set_hash_add_hashed(self, set_hash_of(self, data), data);
 }
 
 int fluff_set_hash_contains(
 		struct FluffSetHash * self, union FluffData data){
-	FluffHashValue hash;
-	struct HashElement * node;
+	struct HashTable * table;
+	size_t i;
 
-	hash = self->hash(data);
-	node = *(self->table + (hash % self->tablesize));
-	while (node){
-		if (node->hash == hash && self->equal(node->data, data)){
-			return 1;
-		}
-		node = node->next;
-	}
-	return 0;
+	SET_HASH_STEP(self);
+	return set_hash_find(self, set_hash_of(self, data), data, &table, &i) != NULL;
 }
 
 int fluff_set_hash_get(
 		struct FluffSetHash * self,
 		union FluffData data,
 		union FluffData * dest){
-	FluffHashValue hash;
-	struct HashElement * node;
+	struct HashTable * table;
+	struct HashSlot * slot;
+	size_t i;
 
-	hash = self->hash(data);
-	node = *(self->table + (hash % self->tablesize));
-	while (node){
-		if (node->hash == hash && self->equal(node->data, data)){
-			if (dest){
-				*dest = node->data;
+	SET_HASH_STEP(self);
+	if (!(slot = set_hash_find(self, set_hash_of(self, data), data, &table, &i))){
+		return 0;
+	}
+	if (dest){
+		*dest = slot->data;
+	}
+	return 1;
+}
+
+union FluffData fluff_set_hash_remove(
+		struct FluffSetHash * self, union FluffData data){
+	struct HashTable * table;
+	struct HashSlot * slot;
+	size_t i;
+
+	SET_HASH_STEP(self);
+	if (!(slot = set_hash_find(self, set_hash_of(self, data), data, &table, &i))){
+		return fluff_data_zero;
+	}
+	data = slot->data;
+	table_erase(table, i);
+	/*
+	 * Halve the table once a quarter of it is used, leaving it half full,
+	 * so that it does not shrink again or grow until that changes a lot
+	 */
+	table = &self->table;
+	if (!self->old.size && table->size > self->min_size
+			&& table->count < table->size * SHRINK){
+		set_hash_resize(self, table->size / 2);
+	}
+	return data;
+}
+
+/*
+ * Number of values hashed ahead of being looked up by the batch functions
+ */
+#define BATCH_SIZE 16
+
+/*
+ * Hash a batch of values and start loading the slots they are likely in
+ * The first group of control bytes of each value is prefetched, then the
+ * first slot in it whose byte matches, so the cache misses of the whole
+ * batch are waited on together instead of one after the other. Only the
+ * current table is prefetched, values still in an old table are found by
+ * the lookup as usual
+ */
+static void set_hash_prefetch(struct FluffSetHash * self,
+		const union FluffData * data, size_t n, FluffHashValue * hashes){
+	struct HashTable * table;
+	unsigned int match;
+	size_t i, pos;
+
+	table = &self->table;
+	for (i = 0; i < n; ++i){
+		hashes[i] = set_hash_of(self, data[i]);
+		__builtin_prefetch(table->ctrl + GROUP_START(table, hashes[i]));
+	}
+	for (i = 0; i < n; ++i){
+		pos = GROUP_START(table, hashes[i]);
+		if ((match = group_match(table->ctrl + pos, CTRL_HASH(hashes[i])))){
+			__builtin_prefetch(table->slots + pos + __builtin_ctz(match));
+		}
+	}
+}
+
+size_t fluff_set_hash_contains_many(struct FluffSetHash * self,
+		const union FluffData * data, size_t n, uint64_t * dest){
+	FluffHashValue hashes[BATCH_SIZE];
+	struct HashTable * table;
+	size_t i, k, m, index, found;
+
+	memset(dest, 0, WORD_INDEX(n + WORD_BITS - 1) * sizeof(uint64_t));
+	found = 0;
+	for (i = 0; i < n; i += m){
+		m = n - i < BATCH_SIZE ? n - i : BATCH_SIZE;
+		if (self->old.size){
+			set_hash_move(self, self->rehash_budget * m);
+		}
+		set_hash_prefetch(self, data + i, m, hashes);
+		for (k = 0; k < m; ++k){
+			if (set_hash_find(self, hashes[k], data[i + k], &table, &index)){
+				dest[WORD_INDEX(i + k)] |= WORD_BIT(i + k);
+				found += 1;
 			}
-			return 1;
 		}
-		node = node->next;
 	}
-	return 0;
+	return found;
+}
 
+void fluff_set_hash_add_many(struct FluffSetHash * self,
+		const union FluffData * data, size_t n){
+	FluffHashValue hashes[BATCH_SIZE];
+	size_t i, k, m, count;
+
+	/*
+	 * Grow once for the whole batch rather than doubling along the way.
+	 * Values already in the set count too, so the table may end up larger
+	 * than needed; removes shrink it again. On failure each add grows
+	 */
+	count = fluff_set_hash_count(self) + n;
+	if (count > self->table.size * ENLARGE){
+		set_hash_resize(self, set_hash_size_for(count));
+	}
+	for (i = 0; i < n; i += m){
+		m = n - i < BATCH_SIZE ? n - i : BATCH_SIZE;
+		if (self->old.size){
+			set_hash_move(self, self->rehash_budget * m);
+		}
+		set_hash_prefetch(self, data + i, m, hashes);
+		for (k = 0; k < m; ++k){
+			set_hash_add_hashed(self, hashes[k], data[i + k]);
+		}
+	}
 }
 
-union FluffData fluff_set_hash_remove(
-		struct FluffSetHash * self, union FluffData data){
-	FluffHashValue hash;
-	struct HashElement ** dest;
-	struct HashElement * node;
+struct FluffSetHashIter * fluff_set_hash_iter(struct FluffSetHash * set){
+	struct FluffSetHashIter * self;
 
-	hash = self->hash(data);
-	dest = self->table + (hash % self->tablesize);
-	while ((node = *dest)){
-		if (node->hash == hash && self->equal(node->data, data)){
-			data = node->data;
-			MM->f_free(node);
-			*dest = NULL;
-			self->count -= 1;
-			return data;
+	if ((self = MM->f_alloc(hashiter_size))){
+		self->set = set;
+		self->index = 0;
+	}
+	return self;
+}
+
+void fluff_set_hash_iter_free(struct FluffSetHashIter * self){
+	MM->f_free(self);
+}
+
+/*
+ * Find the first full slot of a table at or after index
+ * Return its index, or the table's size if there is none
+ */
+static size_t table_next(struct HashTable * table, size_t index){
+	size_t group;
+	unsigned int full;
+
+	while (index < table->size){
+		group = index & ~(size_t)(GROUP_SIZE - 1);
+		full = ~group_match_free(table->ctrl + group) & 0xffff;
+		full &= ~0u << (index - group);
+		if (full){
+			return group + __builtin_ctz(full);
 		}
-		dest = &(node->next);
+		index = group + GROUP_SIZE;
 	}
-	return fluff_data_zero;
+	return table->size;
+}
+
+int fluff_set_hash_iter_next(
+		struct FluffSetHashIter * self, union FluffData * dest){
+	struct HashTable * table;
+	size_t index;
+
+	/* Indexes past the current table continue into the old one */
+	table = &self->set->table;
+	index = self->index;
+	if (index >= table->size){
+		index -= table->size;
+		table = &self->set->old;
+	}
+	if ((index = table_next(table, index)) == table->size){
+		if (table == &self->set->old || !self->set->old.size
+				|| (index = table_next(&self->set->old, 0))
+						== self->set->old.size){
+			self->index = self->set->table.size + self->set->old.size;
+			return 0;
+		}
+		table = &self->set->old;
+	}
+	if (dest){
+		*dest = table->slots[index].data;
+	}
+	self->index = index + 1
+			+ (table == &self->set->old ? self->set->table.size : 0);
+	return 1;
 }
 
 /*
@@ -342,8 +1216,6 @@ union FluffData fluff_set_hash_remove(
 struct FluffSetElement * fluff_set_element_new(){
 	struct FluffSetElement * self;
 
-	ENSURE_MM;
-
 	if ((self = MM->f_alloc(setelement_size))){
 		self->count = 0;
 		self->head = NULL;
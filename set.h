@@ -26,6 +26,7 @@
  * Enum Set
  */
 struct FluffSetEnum;
+struct FluffSetEnumIter;
 
 /*
  * Create a new enum set
@@ -33,6 +34,17 @@ struct FluffSetEnum;
  */
 struct FluffSetEnum * fluff_set_enum_new(unsigned int max);
 
+/*
+ * Create a new enum set which may be used by several threads at once
+ * Values are added, removed and tested with atomic operations, and readers
+ * never wait. The count is split between threads, so it may be briefly off
+ * while values change. Set operations, which rewrite a whole set, must not
+ * run while other threads change either set. Iterators are allocated from
+ * the module's memory manager, which must then be thread safe
+ * Returns new enum set on success, NULL on failure
+ */
+struct FluffSetEnum * fluff_set_enum_new_atomic(unsigned int max);
+
 /*
  * Invalidate the enum set
  */
@@ -60,6 +72,199 @@ int fluff_set_enum_contains(struct FluffSetEnum *, unsigned int n);
  */
 void fluff_set_enum_remove(struct FluffSetEnum *, unsigned int n);
 
+/*
+ * Add a value to the enum set
+ * Return 1 if the value was already contained, 0 otherwise
+ */
+int fluff_set_enum_test_and_set(struct FluffSetEnum *, unsigned int n);
+
+/*
+ * Remove a value from the enum set
+ * Return 1 if the value was contained, 0 otherwise
+ */
+int fluff_set_enum_test_and_clear(struct FluffSetEnum *, unsigned int n);
+
+/*
+ * Find the smallest value in the enum set
+ * Return the value, or the set's max if the set is empty
+ */
+unsigned int fluff_set_enum_find_first(struct FluffSetEnum *);
+
+/*
+ * Find the smallest value in the enum set greater than n
+ * Return the value, or the set's max if there is none
+ */
+unsigned int fluff_set_enum_find_next(struct FluffSetEnum *, unsigned int n);
+
+/*
+ * Return the number of values in the enum set less than n
+ */
+unsigned int fluff_set_enum_rank(struct FluffSetEnum *, unsigned int n);
+
+/*
+ * Find the value of rank k, the k + 1th smallest in the enum set
+ * Return the value, or the set's max if the set has k values or fewer
+ */
+unsigned int fluff_set_enum_select(struct FluffSetEnum *, unsigned int k);
+
+/*
+ * Return the number of values in the enum set from start up to, but not
+ * including, stop
+ */
+unsigned int fluff_set_enum_count_range(
+		struct FluffSetEnum *, unsigned int start, unsigned int stop);
+
+/*
+ * Set operations, done a machine word or more at a time
+ * The in place forms store the result in the first set, dropping values
+ * not less than its max. The _new forms return a new enum set, or NULL on
+ * failure, whose max is the larger of the two for union and symmetric
+ * difference, the smaller for intersection, and the first's for difference
+ */
+void fluff_set_enum_union(struct FluffSetEnum *, struct FluffSetEnum *);
+void fluff_set_enum_intersection(struct FluffSetEnum *, struct FluffSetEnum *);
+void fluff_set_enum_difference(struct FluffSetEnum *, struct FluffSetEnum *);
+void fluff_set_enum_symmetric_difference(
+		struct FluffSetEnum *, struct FluffSetEnum *);
+struct FluffSetEnum * fluff_set_enum_union_new(
+		struct FluffSetEnum *, struct FluffSetEnum *);
+struct FluffSetEnum * fluff_set_enum_intersection_new(
+		struct FluffSetEnum *, struct FluffSetEnum *);
+struct FluffSetEnum * fluff_set_enum_difference_new(
+		struct FluffSetEnum *, struct FluffSetEnum *);
+struct FluffSetEnum * fluff_set_enum_symmetric_difference_new(
+		struct FluffSetEnum *, struct FluffSetEnum *);
+
+/*
+ * Check if every value in the first enum set is in the second
+ */
+int fluff_set_enum_subset(struct FluffSetEnum *, struct FluffSetEnum *);
+
+/*
+ * Check if the enum sets have no value in common
+ */
+int fluff_set_enum_disjoint(struct FluffSetEnum *, struct FluffSetEnum *);
+
+/*
+ * Get an iterator over the enum set, returning values in increasing order
+ * Values added or removed while the iterator is active may or may not be
+ * returned
+ */
+struct FluffSetEnumIter * fluff_set_enum_iter(struct FluffSetEnum *);
+
+/*
+ * Release and invalidate the enum set iterator
+ */
+void fluff_set_enum_iter_free(struct FluffSetEnumIter *);
+
+/*
+ * Get the next value from the iterator
+ * Return 1 if there was a value to get, 0 if there was not
+ */
+int fluff_set_enum_iter_next(struct FluffSetEnumIter *, unsigned int *);
+
+/*
+ * Roaring set
+ * A set of 32 bit values, split into chunks of 65536 values stored as a
+ * sorted array, a bitmap or a list of runs, whichever suits the chunk.
+ * Memory grows with the values contained rather than the largest value,
+ * for use where an enum set would be too large
+ */
+struct FluffSetRoaring;
+struct FluffSetRoaringIter;
+
+/*
+ * Create a new roaring set
+ * Returns new roaring set on success, NULL on failure
+ */
+struct FluffSetRoaring * fluff_set_roaring_new();
+
+/*
+ * Invalidate the roaring set
+ */
+void fluff_set_roaring_free(struct FluffSetRoaring *);
+
+/*
+ * Get number of values in the set
+ * Return the cardinality of the roaring set
+ */
+uint64_t fluff_set_roaring_count(struct FluffSetRoaring *);
+
+/*
+ * Return the number of bytes of memory used by the roaring set
+ */
+size_t fluff_set_roaring_bytes(struct FluffSetRoaring *);
+
+/*
+ * Add a value to the roaring set
+ */
+void fluff_set_roaring_add(struct FluffSetRoaring *, uint32_t n);
+
+/*
+ * Add the values from start up to, but not including, stop
+ * Whole chunks are stored as single runs
+ */
+void fluff_set_roaring_add_range(
+		struct FluffSetRoaring *, uint64_t start, uint64_t stop);
+
+/*
+ * Check if the roaring set contains the specified value
+ * Return 1 if the value is contained, 0 otherwise
+ */
+int fluff_set_roaring_contains(struct FluffSetRoaring *, uint32_t n);
+
+/*
+ * Remove a value from the roaring set
+ */
+void fluff_set_roaring_remove(struct FluffSetRoaring *, uint32_t n);
+
+/*
+ * Store each chunk in its smallest form, using runs where they are smaller,
+ * and release room kept for growth
+ */
+void fluff_set_roaring_optimize(struct FluffSetRoaring *);
+
+/*
+ * Set operations
+ * The in place forms store the result in the first set, and leave it
+ * unchanged on failure. The _new forms return a new roaring set, or NULL on
+ * failure
+ */
+void fluff_set_roaring_union(
+		struct FluffSetRoaring *, struct FluffSetRoaring *);
+void fluff_set_roaring_intersection(
+		struct FluffSetRoaring *, struct FluffSetRoaring *);
+void fluff_set_roaring_difference(
+		struct FluffSetRoaring *, struct FluffSetRoaring *);
+void fluff_set_roaring_symmetric_difference(
+		struct FluffSetRoaring *, struct FluffSetRoaring *);
+struct FluffSetRoaring * fluff_set_roaring_union_new(
+		struct FluffSetRoaring *, struct FluffSetRoaring *);
+struct FluffSetRoaring * fluff_set_roaring_intersection_new(
+		struct FluffSetRoaring *, struct FluffSetRoaring *);
+struct FluffSetRoaring * fluff_set_roaring_difference_new(
+		struct FluffSetRoaring *, struct FluffSetRoaring *);
+struct FluffSetRoaring * fluff_set_roaring_symmetric_difference_new(
+		struct FluffSetRoaring *, struct FluffSetRoaring *);
+
+/*
+ * Get an iterator over the roaring set, returning values in increasing order
+ * While the iterator is active, no operations may be performed on the
+ * set directly.
+ */
+struct FluffSetRoaringIter * fluff_set_roaring_iter(struct FluffSetRoaring *);
+
+/*
+ * Release and invalidate the roaring set iterator
+ */
+void fluff_set_roaring_iter_free(struct FluffSetRoaringIter *);
+
+/*
+ * Get the next value from the iterator
+ * Return 1 if there was a value to get, 0 if there was not
+ */
+int fluff_set_roaring_iter_next(struct FluffSetRoaringIter *, uint32_t *);
+
 /*
  * Hash set
  */
@@ -72,6 +277,13 @@ struct FluffSetHashIter;
 struct FluffSetHash * fluff_set_hash_new(
 		FluffHashFunction, FluffEqualFunction);
 
+/*
+ * Create a new hash set allocated by the given memory manager instead of
+ * the module's
+ */
+struct FluffSetHash * fluff_set_hash_new_mm(
+		FluffHashFunction, FluffEqualFunction, const struct FluffMM *);
+
 /*
  * Invalidate the hash set
  */
@@ -83,6 +295,37 @@ void fluff_set_hash_free(struct FluffSetHash *, FluffFreeFunction);
  */
 unsigned int fluff_set_hash_count(struct FluffSetHash *);
 
+/*
+ * Set the number of slots moved by each operation while the hash set grows
+ * With a budget, a growing set keeps its old table alongside the new one
+ * and moves values over a few at a time, in groups of 16 slots, instead of
+ * all at once in the add which made it grow. 0 moves them all at once, and
+ * is the default
+ */
+void fluff_set_hash_set_rehash_budget(struct FluffSetHash *, size_t budget);
+
+/*
+ * Move up to budget slots, rounded up to whole groups, into the new table
+ * of a growing hash set, for example while the program is idle
+ * Return 1 if values remain to be moved, 0 otherwise
+ */
+int fluff_set_hash_rehash_step(struct FluffSetHash *, size_t budget);
+
+/*
+ * Make room for n values in the hash set, so adding up to n values does not
+ * grow it, and removing values does not shrink it below that size
+ * Return 0 on success, -1 on failure
+ */
+int fluff_set_hash_reserve(struct FluffSetHash *, size_t n);
+
+/*
+ * Shrink the hash set's table to the smallest size holding its values,
+ * moving every value at once, and undo fluff_set_hash_reserve
+ * Tables also shrink on their own as values are removed
+ * Return 0 on success, -1 on failure
+ */
+int fluff_set_hash_shrink_to_fit(struct FluffSetHash *);
+
 /*
  * Add a value to the hash set
  */
@@ -94,6 +337,24 @@ void fluff_set_hash_add(struct FluffSetHash *, union FluffData);
  */
 int fluff_set_hash_contains(struct FluffSetHash *, union FluffData);
 
+/*
+ * Add n values to the hash set
+ * The values are hashed and their slots prefetched a batch at a time, which
+ * is faster than adding them one by one once the table outgrows the cache
+ */
+void fluff_set_hash_add_many(
+		struct FluffSetHash *, const union FluffData *, size_t n);
+
+/*
+ * Check which of n values the hash set contains
+ * Bit i % 64 of dest[i / 64] is set if value i is contained, and cleared
+ * otherwise; dest must hold (n + 63) / 64 words. Lookups are batched like
+ * fluff_set_hash_add_many
+ * Return the number of values contained
+ */
+size_t fluff_set_hash_contains_many(struct FluffSetHash *,
+		const union FluffData *, size_t n, uint64_t * dest);
+
 /*
  * Get an equivalent value from the set
  * Return 1 if the value was successfully fetched, 0 otherwise
@@ -223,4 +484,14 @@ struct FluffSetElementElement * fluff_set_element_iter_next(
 void fluff_set_element_iter_removelast(
 		struct FluffSetElementIter *);
 
+/*
+ * Set the memory manager used by this module
+ */
+void fluff_set_setmm(const struct FluffMM *);
+
+/*
+ * Set the memory manager used by roaring sets
+ */
+void fluff_set_roaring_setmm(const struct FluffMM *);
+
 #endif /* FLUFF_SET_H_ */
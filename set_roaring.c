@@ -0,0 +1,1125 @@
+/*
+	Copyright 2014 Sky Leonard
+	This file is part of libfluff.
+
+    libfluff is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libfluff is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with libfluff.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "set.h"
+#include "bitwords.h"
+
+#include <string.h>
+
+/*
+ * A value's high 16 bits select a container, its low 16 bits are stored in
+ * the container as one of
+ *  - a sorted array of values, while it has at most ARRAY_MAX values
+ *  - a bitmap of CHUNK_WORDS words
+ *  - a sorted array of runs of consecutive values
+ * Containers are kept sorted by key and are never empty. Arrays become
+ * bitmaps when they outgrow ARRAY_MAX, and bitmaps only become arrays again
+ * below half of it, so a container at the limit does not flip back and forth.
+ * Run containers come from fluff_set_roaring_add_range and
+ * fluff_set_roaring_optimize, and become arrays or bitmaps when they grow
+ * larger than either
+ */
+#define CHUNK_VALUES 65536
+#define CHUNK_WORDS (CHUNK_VALUES / 64)
+#define ARRAY_MAX 4096
+
+#define KIND_ARRAY 0
+#define KIND_BITMAP 1
+#define KIND_RUN 2
+
+#define ARRAY_BYTES(n) ((size_t)(n) * sizeof(uint16_t))
+#define BITMAP_BYTES (CHUNK_WORDS * sizeof(uint64_t))
+#define RUN_BYTES(n) ((size_t)(n) * sizeof(struct RoaringRun))
+
+/* Which values of each side an operation keeps */
+#define KEEP_A 1
+#define KEEP_B 2
+#define KEEP_BOTH 4
+
+#define OP_OR (KEEP_A | KEEP_B | KEEP_BOTH)
+#define OP_AND (KEEP_BOTH)
+#define OP_ANDNOT (KEEP_A)
+#define OP_XOR (KEEP_A | KEEP_B)
+
+struct RoaringRun {
+	uint16_t start;
+	uint16_t last;
+};
+
+struct RoaringContainer {
+	uint16_t key;
+	uint16_t kind;
+	/* Number of values, 1 to CHUNK_VALUES */
+	uint32_t card;
+	/* Values in an array or runs in a run container, and room for them */
+	uint32_t n;
+	uint32_t cap;
+	union {
+		void * ptr;
+		uint16_t * array;
+		uint64_t * bitmap;
+		struct RoaringRun * runs;
+	} u;
+};
+
+struct FluffSetRoaring {
+	uint64_t count;
+	uint32_t n;
+	uint32_t cap;
+	struct RoaringContainer * containers;
+};
+
+struct FluffSetRoaringIter {
+	struct FluffSetRoaring * set;
+	uint32_t index;
+	/* Next array value, bitmap word or run of the container */
+	uint32_t pos;
+	/* Next value of the current run */
+	uint32_t value;
+	/* Values of the current bitmap word not yet returned */
+	uint64_t word;
+};
+
+/*
+ * Memory manager
+ */
+
+static int mm_need_setup = 1;
+static const struct FluffMM * MM = NULL;
+
+static union FluffData roaring_size;
+static union FluffData roaringiter_size;
+
+static void setup_mm(){
+	if (MM == NULL){
+		MM = fluff_mm_default;
+	}
+	roaring_size = MM->f_type_new(sizeof(struct FluffSetRoaring));
+	roaringiter_size = MM->f_type_new(sizeof(struct FluffSetRoaringIter));
+	mm_need_setup = 0;
+}
+
+static void __attribute__((constructor)) init_mm(){
+	if (mm_need_setup){
+		setup_mm();
+	}
+}
+
+void fluff_set_roaring_setmm(const struct FluffMM * mm){
+	if (!mm_need_setup){
+		MM->f_type_free(roaring_size);
+		MM->f_type_free(roaringiter_size);
+		mm_need_setup = 1;
+	}
+	MM = mm;
+	setup_mm();
+}
+
+/*
+ * Bitmap helpers
+ */
+
+static void words_set_range(uint64_t * words, uint32_t start, uint32_t last){
+	uint32_t first_word, last_word, i;
+	uint64_t first_mask, last_mask;
+
+	first_word = start / 64;
+	last_word = last / 64;
+	first_mask = ~(uint64_t)0 << (start % 64);
+	last_mask = ~(uint64_t)0 >> (63 - last % 64);
+	if (first_word == last_word){
+		words[first_word] |= first_mask & last_mask;
+		return;
+	}
+	words[first_word] |= first_mask;
+	for (i = first_word + 1; i < last_word; ++i){
+		words[i] = ~(uint64_t)0;
+	}
+	words[last_word] |= last_mask;
+}
+
+/*
+ * Return the number of runs of set bits in the words
+ */
+static uint32_t words_count_runs(const uint64_t * words){
+	uint32_t i, runs;
+	uint64_t prev;
+
+	runs = 0;
+	prev = 0;
+	for (i = 0; i < CHUNK_WORDS; ++i){
+		/* A run starts at each set bit whose lower neighbour is clear */
+		runs += __builtin_popcountll(words[i] & ~((words[i] << 1) | (prev >> 63)));
+		prev = words[i];
+	}
+	return runs;
+}
+
+/*
+ * Containers
+ */
+
+/*
+ * Find the index of the first of n sorted values not less than value
+ */
+static uint32_t array_search(
+		const uint16_t * array, uint32_t n, uint16_t value){
+	uint32_t low, high, mid;
+
+	low = 0;
+	high = n;
+	while (low < high){
+		mid = (low + high) / 2;
+		if (array[mid] < value){
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/*
+ * Find the index of the last of n runs starting at or before value
+ * Return -1 if every run starts after value
+ */
+static int32_t run_search(
+		const struct RoaringRun * runs, uint32_t n, uint16_t value){
+	uint32_t low, high, mid;
+
+	low = 0;
+	high = n;
+	while (low < high){
+		mid = (low + high) / 2;
+		if (runs[mid].start <= value){
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return (int32_t)low - 1;
+}
+
+static size_t container_bytes(struct RoaringContainer * c){
+	switch (c->kind){
+	case KIND_ARRAY:
+		return ARRAY_BYTES(c->cap);
+	case KIND_BITMAP:
+		return BITMAP_BYTES;
+	default:
+		return RUN_BYTES(c->cap);
+	}
+}
+
+/*
+ * Make room for n entries of size bytes in an array or run container
+ */
+static int container_reserve(
+		struct RoaringContainer * c, uint32_t n, size_t size){
+	uint32_t cap;
+	void * ptr;
+
+	if (n <= c->cap){
+		return 0;
+	}
+	cap = c->cap ? c->cap * 2 : 4;
+	if (cap < n){
+		cap = n;
+	}
+	if (!(ptr = MM->f_realloc(c->u.ptr, cap * size))){
+		return -1;
+	}
+	c->u.ptr = ptr;
+	c->cap = cap;
+	return 0;
+}
+
+/*
+ * Write the values of a container as a bitmap into words
+ */
+static void container_to_words(struct RoaringContainer * c, uint64_t * words){
+	uint32_t i;
+
+	switch (c->kind){
+	case KIND_ARRAY:
+		memset(words, 0, BITMAP_BYTES);
+		for (i = 0; i < c->n; ++i){
+			words[c->u.array[i] / 64] |= (uint64_t)1 << (c->u.array[i] % 64);
+		}
+		break;
+	case KIND_BITMAP:
+		memcpy(words, c->u.bitmap, BITMAP_BYTES);
+		break;
+	case KIND_RUN:
+		memset(words, 0, BITMAP_BYTES);
+		for (i = 0; i < c->n; ++i){
+			words_set_range(words, c->u.runs[i].start, c->u.runs[i].last);
+		}
+		break;
+	}
+}
+
+/*
+ * Build a container of the given kind from a bitmap of card values
+ * runs is the number of runs in the bitmap, needed for KIND_RUN
+ */
+static int container_from_words(struct RoaringContainer * c,
+		const uint64_t * words, uint32_t card, int kind, uint32_t runs){
+	uint32_t i, n, bit;
+	uint64_t word;
+
+	c->card = card;
+	c->kind = kind;
+	switch (kind){
+	case KIND_ARRAY:
+		if (!(c->u.array = MM->f_alloc_size(ARRAY_BYTES(card)))){
+			return -1;
+		}
+		n = 0;
+		for (i = 0; i < CHUNK_WORDS; ++i){
+			for (word = words[i]; word; word &= word - 1){
+				c->u.array[n++] = i * 64 + __builtin_ctzll(word);
+			}
+		}
+		c->n = c->cap = card;
+		break;
+	case KIND_BITMAP:
+		if (!(c->u.bitmap = MM->f_alloc_size(BITMAP_BYTES))){
+			return -1;
+		}
+		memcpy(c->u.bitmap, words, BITMAP_BYTES);
+		c->n = c->cap = 0;
+		break;
+	case KIND_RUN:
+		if (!(c->u.runs = MM->f_alloc_size(RUN_BYTES(runs)))){
+			return -1;
+		}
+		n = 0;
+		i = 0;
+		word = words[0];
+		while (1){
+			while (!word && ++i < CHUNK_WORDS){
+				word = words[i];
+			}
+			if (i >= CHUNK_WORDS){
+				break;
+			}
+			/* Start at the lowest set bit, then skip to the lowest clear one */
+			bit = __builtin_ctzll(word);
+			c->u.runs[n].start = i * 64 + bit;
+			word |= ((uint64_t)1 << bit) - 1;
+			while (word == ~(uint64_t)0 && ++i < CHUNK_WORDS){
+				word = words[i];
+			}
+			if (i >= CHUNK_WORDS){
+				c->u.runs[n++].last = CHUNK_VALUES - 1;
+				break;
+			}
+			bit = __builtin_ctzll(~word);
+			c->u.runs[n++].last = i * 64 + bit - 1;
+			word &= ~(((uint64_t)1 << bit) - 1);
+		}
+		c->n = c->cap = runs;
+		break;
+	}
+	return 0;
+}
+
+/*
+ * The smallest kind for a container with card values in runs runs
+ */
+static int container_best_kind(uint32_t card, uint32_t runs){
+	size_t plain;
+
+	plain = card <= ARRAY_MAX ? ARRAY_BYTES(card) : BITMAP_BYTES;
+	if (runs && RUN_BYTES(runs) < plain){
+		return KIND_RUN;
+	}
+	return card <= ARRAY_MAX ? KIND_ARRAY : KIND_BITMAP;
+}
+
+/*
+ * Change the kind of a container, keeping its values
+ */
+static int container_convert(struct RoaringContainer * c, int kind){
+	uint64_t words[CHUNK_WORDS];
+	struct RoaringContainer old;
+
+	if (c->kind == kind){
+		return 0;
+	}
+	old = *c;
+	container_to_words(&old, words);
+	if (container_from_words(c, words, old.card, kind,
+			kind == KIND_RUN ? words_count_runs(words) : 0)){
+		*c = old;
+		return -1;
+	}
+	MM->f_free(old.u.ptr);
+	return 0;
+}
+
+static int container_copy(
+		struct RoaringContainer * dest, struct RoaringContainer * src){
+	size_t size;
+
+	*dest = *src;
+	size = src->kind == KIND_ARRAY ? ARRAY_BYTES(src->n)
+			: src->kind == KIND_RUN ? RUN_BYTES(src->n) : BITMAP_BYTES;
+	if (!(dest->u.ptr = MM->f_alloc_size(size))){
+		return -1;
+	}
+	memcpy(dest->u.ptr, src->u.ptr, size);
+	if (src->kind != KIND_BITMAP){
+		dest->cap = src->n;
+	}
+	return 0;
+}
+
+static int container_contains(struct RoaringContainer * c, uint16_t value){
+	uint32_t i;
+	int32_t r;
+
+	switch (c->kind){
+	case KIND_ARRAY:
+		i = array_search(c->u.array, c->n, value);
+		return i < c->n && c->u.array[i] == value;
+	case KIND_BITMAP:
+		return (c->u.bitmap[value / 64] >> (value % 64)) & 1;
+	default:
+		r = run_search(c->u.runs, c->n, value);
+		return r >= 0 && value <= c->u.runs[r].last;
+	}
+}
+
+/*
+ * Add a value to a container
+ * Return 1 if it was added, 0 if it was already there, -1 on failure
+ */
+static int container_add(struct RoaringContainer * c, uint16_t value){
+	struct RoaringRun * runs;
+	uint64_t * word;
+	uint32_t i;
+	int32_t r;
+	int extend_prev, extend_next;
+
+	switch (c->kind){
+	case KIND_ARRAY:
+		i = array_search(c->u.array, c->n, value);
+		if (i < c->n && c->u.array[i] == value){
+			return 0;
+		}
+		if (c->n == ARRAY_MAX){
+			if (container_convert(c, KIND_BITMAP)){
+				return -1;
+			}
+			return container_add(c, value);
+		}
+		if (container_reserve(c, c->n + 1, sizeof(uint16_t))){
+			return -1;
+		}
+		memmove(c->u.array + i + 1, c->u.array + i, ARRAY_BYTES(c->n - i));
+		c->u.array[i] = value;
+		c->n += 1;
+		break;
+	case KIND_BITMAP:
+		word = c->u.bitmap + value / 64;
+		if (*word & ((uint64_t)1 << (value % 64))){
+			return 0;
+		}
+		*word |= (uint64_t)1 << (value % 64);
+		break;
+	case KIND_RUN:
+		r = run_search(c->u.runs, c->n, value);
+		if (r >= 0 && value <= c->u.runs[r].last){
+			return 0;
+		}
+		extend_prev = r >= 0 && c->u.runs[r].last + 1 == value;
+		extend_next = (uint32_t)(r + 1) < c->n
+				&& c->u.runs[r + 1].start == value + 1;
+		if (extend_prev && extend_next){
+			runs = c->u.runs;
+			runs[r].last = runs[r + 1].last;
+			memmove(runs + r + 1, runs + r + 2, RUN_BYTES(c->n - r - 2));
+			c->n -= 1;
+		} else if (extend_prev){
+			c->u.runs[r].last = value;
+		} else if (extend_next){
+			c->u.runs[r + 1].start = value;
+		} else {
+			if (RUN_BYTES(c->n + 1) > (c->card + 1 <= ARRAY_MAX
+					? ARRAY_BYTES(c->card + 1) : BITMAP_BYTES)){
+				if (container_convert(c, c->card + 1 <= ARRAY_MAX
+						? KIND_ARRAY : KIND_BITMAP)){
+					return -1;
+				}
+				return container_add(c, value);
+			}
+			if (container_reserve(c, c->n + 1, sizeof(struct RoaringRun))){
+				return -1;
+			}
+			runs = c->u.runs;
+			memmove(runs + r + 2, runs + r + 1, RUN_BYTES(c->n - r - 1));
+			runs[r + 1].start = runs[r + 1].last = value;
+			c->n += 1;
+		}
+		break;
+	}
+	c->card += 1;
+	return 1;
+}
+
+/*
+ * Remove a value from a container
+ * Return 1 if it was removed, 0 if it was not there, -1 on failure
+ */
+static int container_remove(struct RoaringContainer * c, uint16_t value){
+	struct RoaringRun * runs;
+	uint64_t * word;
+	uint32_t i;
+	int32_t r;
+
+	switch (c->kind){
+	case KIND_ARRAY:
+		i = array_search(c->u.array, c->n, value);
+		if (i >= c->n || c->u.array[i] != value){
+			return 0;
+		}
+		memmove(c->u.array + i, c->u.array + i + 1,
+				ARRAY_BYTES(c->n - i - 1));
+		c->n -= 1;
+		break;
+	case KIND_BITMAP:
+		word = c->u.bitmap + value / 64;
+		if (!(*word & ((uint64_t)1 << (value % 64)))){
+			return 0;
+		}
+		*word &= ~((uint64_t)1 << (value % 64));
+		if (c->card - 1 <= ARRAY_MAX / 2){
+			/* Left a bitmap if there is no memory for the array */
+			c->card -= 1;
+			container_convert(c, KIND_ARRAY);
+			return 1;
+		}
+		break;
+	case KIND_RUN:
+		r = run_search(c->u.runs, c->n, value);
+		if (r < 0 || value > c->u.runs[r].last){
+			return 0;
+		}
+		runs = c->u.runs;
+		if (runs[r].start == runs[r].last){
+			memmove(runs + r, runs + r + 1, RUN_BYTES(c->n - r - 1));
+			c->n -= 1;
+		} else if (runs[r].start == value){
+			runs[r].start += 1;
+		} else if (runs[r].last == value){
+			runs[r].last -= 1;
+		} else {
+			/* Split the run around value */
+			if (container_reserve(c, c->n + 1, sizeof(struct RoaringRun))){
+				return -1;
+			}
+			runs = c->u.runs;
+			memmove(runs + r + 2, runs + r + 1, RUN_BYTES(c->n - r - 1));
+			runs[r + 1].start = value + 1;
+			runs[r + 1].last = runs[r].last;
+			runs[r].last = value - 1;
+			c->n += 1;
+		}
+		break;
+	}
+	c->card -= 1;
+	return 1;
+}
+
+/*
+ * Store op of two containers with the same key in dest
+ * Return 0 on success, 1 if the result is empty and nothing was allocated,
+ * -1 on failure
+ */
+static int container_op(struct RoaringContainer * dest,
+		struct RoaringContainer * a, struct RoaringContainer * b, int op){
+	uint64_t words_a[CHUNK_WORDS], words_b[CHUNK_WORDS];
+	uint64_t * words;
+	uint32_t i, j, n;
+	uint16_t value;
+	size_t card;
+	int keep;
+
+	dest->key = a->key;
+	if (a->kind == KIND_ARRAY && b->kind == KIND_ARRAY){
+		/* Merge the sorted arrays */
+		if (!(dest->u.array = MM->f_alloc_size(ARRAY_BYTES(a->n + b->n)))){
+			return -1;
+		}
+		n = i = j = 0;
+		while (i < a->n || j < b->n){
+			if (j >= b->n || (i < a->n && a->u.array[i] < b->u.array[j])){
+				value = a->u.array[i++];
+				keep = op & KEEP_A;
+			} else if (i >= a->n || b->u.array[j] < a->u.array[i]){
+				value = b->u.array[j++];
+				keep = op & KEEP_B;
+			} else {
+				value = a->u.array[i++];
+				j++;
+				keep = op & KEEP_BOTH;
+			}
+			if (keep){
+				dest->u.array[n++] = value;
+			}
+		}
+		dest->kind = KIND_ARRAY;
+		dest->card = dest->n = dest->cap = n;
+		if (!n){
+			MM->f_free(dest->u.array);
+			return 1;
+		}
+		if (n > ARRAY_MAX && container_convert(dest, KIND_BITMAP)){
+			MM->f_free(dest->u.array);
+			return -1;
+		}
+		return 0;
+	}
+	if (a->kind == KIND_ARRAY && !(op & KEEP_B)){
+		/* Filter a by membership in b */
+		if (!(dest->u.array = MM->f_alloc_size(ARRAY_BYTES(a->n)))){
+			return -1;
+		}
+		n = 0;
+		for (i = 0; i < a->n; ++i){
+			keep = container_contains(b, a->u.array[i]) ? op & KEEP_BOTH
+					: op & KEEP_A;
+			if (keep){
+				dest->u.array[n++] = a->u.array[i];
+			}
+		}
+		dest->kind = KIND_ARRAY;
+		dest->card = dest->n = dest->cap = n;
+		if (!n){
+			MM->f_free(dest->u.array);
+			return 1;
+		}
+		return 0;
+	}
+	/* Combine as bitmaps */
+	if (!(words = MM->f_alloc_size(BITMAP_BYTES))){
+		return -1;
+	}
+	if (a->kind != KIND_BITMAP){
+		container_to_words(a, words_a);
+	}
+	if (b->kind != KIND_BITMAP){
+		container_to_words(b, words_b);
+	}
+	card = (op == OP_OR ? fluff_bitwords->f_or
+			: op == OP_AND ? fluff_bitwords->f_and
+			: op == OP_ANDNOT ? fluff_bitwords->f_andnot
+			: fluff_bitwords->f_xor)(words,
+					a->kind == KIND_BITMAP ? a->u.bitmap : words_a,
+					b->kind == KIND_BITMAP ? b->u.bitmap : words_b,
+					CHUNK_WORDS);
+	dest->kind = KIND_BITMAP;
+	dest->u.bitmap = words;
+	dest->card = card;
+	dest->n = dest->cap = 0;
+	if (!card){
+		MM->f_free(words);
+		return 1;
+	}
+	if (card <= ARRAY_MAX && container_convert(dest, KIND_ARRAY)){
+		MM->f_free(words);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Sets
+ */
+
+/*
+ * Find the index of the first container whose key is not less than key
+ */
+static uint32_t roaring_search(struct FluffSetRoaring * self, uint16_t key){
+	uint32_t low, high, mid;
+
+	/* Values are often added in order */
+	if (self->n && self->containers[self->n - 1].key < key){
+		return self->n;
+	}
+	low = 0;
+	high = self->n;
+	while (low < high){
+		mid = (low + high) / 2;
+		if (self->containers[mid].key < key){
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+static struct RoaringContainer * roaring_get(
+		struct FluffSetRoaring * self, uint16_t key){
+	uint32_t i;
+
+	i = roaring_search(self, key);
+	if (i < self->n && self->containers[i].key == key){
+		return self->containers + i;
+	}
+	return NULL;
+}
+
+static int roaring_reserve(struct FluffSetRoaring * self, uint32_t n){
+	struct RoaringContainer * containers;
+	uint32_t cap;
+
+	if (n <= self->cap){
+		return 0;
+	}
+	cap = self->cap ? self->cap * 2 : 4;
+	if (cap < n){
+		cap = n;
+	}
+	containers = MM->f_realloc(
+			self->containers, cap * sizeof(struct RoaringContainer));
+	if (!containers){
+		return -1;
+	}
+	self->containers = containers;
+	self->cap = cap;
+	return 0;
+}
+
+/*
+ * Insert an empty container at index i
+ */
+static struct RoaringContainer * roaring_insert(
+		struct FluffSetRoaring * self, uint32_t i, uint16_t key){
+	struct RoaringContainer * c;
+
+	if (roaring_reserve(self, self->n + 1)){
+		return NULL;
+	}
+	c = self->containers + i;
+	memmove(c + 1, c, (self->n - i) * sizeof(struct RoaringContainer));
+	self->n += 1;
+	c->key = key;
+	c->kind = KIND_ARRAY;
+	c->card = c->n = c->cap = 0;
+	c->u.ptr = NULL;
+	return c;
+}
+
+static void roaring_erase(struct FluffSetRoaring * self, uint32_t i){
+	struct RoaringContainer * c;
+
+	c = self->containers + i;
+	if (c->u.ptr){
+		MM->f_free(c->u.ptr);
+	}
+	memmove(c, c + 1, (self->n - i - 1) * sizeof(struct RoaringContainer));
+	self->n -= 1;
+}
+
+static void roaring_clear(struct FluffSetRoaring * self){
+	uint32_t i;
+
+	/* Containers moved out by roaring_apply are left without a block */
+	for (i = 0; i < self->n; ++i){
+		if (self->containers[i].u.ptr){
+			MM->f_free(self->containers[i].u.ptr);
+		}
+	}
+	self->n = 0;
+	self->count = 0;
+}
+
+struct FluffSetRoaring * fluff_set_roaring_new(){
+	struct FluffSetRoaring * self;
+
+	if ((self = MM->f_alloc(roaring_size))){
+		self->count = 0;
+		self->n = self->cap = 0;
+		self->containers = NULL;
+	}
+	return self;
+}
+
+void fluff_set_roaring_free(struct FluffSetRoaring * self){
+	roaring_clear(self);
+	if (self->containers){
+		MM->f_free(self->containers);
+	}
+	MM->f_free(self);
+}
+
+uint64_t fluff_set_roaring_count(struct FluffSetRoaring * self){
+	return self->count;
+}
+
+size_t fluff_set_roaring_bytes(struct FluffSetRoaring * self){
+	size_t bytes;
+	uint32_t i;
+
+	bytes = sizeof(struct FluffSetRoaring)
+			+ self->cap * sizeof(struct RoaringContainer);
+	for (i = 0; i < self->n; ++i){
+		bytes += container_bytes(self->containers + i);
+	}
+	return bytes;
+}
+
+void fluff_set_roaring_add(struct FluffSetRoaring * self, uint32_t n){
+	struct RoaringContainer * c;
+	uint32_t i;
+
+	i = roaring_search(self, n >> 16);
+	if (i < self->n && self->containers[i].key == n >> 16){
+		c = self->containers + i;
+	} else if (!(c = roaring_insert(self, i, n >> 16))){
+		return;
+	}
+	switch (container_add(c, n & 0xffff)){
+	case 1:
+		self->count += 1;
+		break;
+	case -1:
+		if (!c->card){
+			roaring_erase(self, i);
+		}
+		break;
+	}
+}
+
+void fluff_set_roaring_add_range(
+		struct FluffSetRoaring * self, uint64_t start, uint64_t stop){
+	uint64_t words[CHUNK_WORDS];
+	struct RoaringContainer * c;
+	struct RoaringContainer old;
+	uint32_t i, first, last, card, runs;
+
+	if (stop > (uint64_t)1 << 32){
+		stop = (uint64_t)1 << 32;
+	}
+	for (; start < stop; start = ((start >> 16) + 1) << 16){
+		first = start & 0xffff;
+		last = (stop - 1) >> 16 == start >> 16 ? (stop - 1) & 0xffff
+				: CHUNK_VALUES - 1;
+		i = roaring_search(self, start >> 16);
+		if (i < self->n && self->containers[i].key == start >> 16){
+			c = self->containers + i;
+			old = *c;
+			container_to_words(c, words);
+			words_set_range(words, first, last);
+			card = fluff_bitwords->f_popcount(words, CHUNK_WORDS);
+			runs = words_count_runs(words);
+			if (container_from_words(c, words, card,
+					container_best_kind(card, runs), runs)){
+				*c = old;
+				return;
+			}
+			MM->f_free(old.u.ptr);
+			self->count += card - old.card;
+		} else {
+			if (!(c = roaring_insert(self, i, start >> 16))){
+				return;
+			}
+			if (!(c->u.runs = MM->f_alloc_size(RUN_BYTES(1)))){
+				roaring_erase(self, i);
+				return;
+			}
+			c->kind = KIND_RUN;
+			c->u.runs[0].start = first;
+			c->u.runs[0].last = last;
+			c->n = c->cap = 1;
+			c->card = last - first + 1;
+			self->count += c->card;
+		}
+	}
+}
+
+int fluff_set_roaring_contains(struct FluffSetRoaring * self, uint32_t n){
+	struct RoaringContainer * c;
+
+	return (c = roaring_get(self, n >> 16)) && container_contains(c, n & 0xffff);
+}
+
+void fluff_set_roaring_remove(struct FluffSetRoaring * self, uint32_t n){
+	uint32_t i;
+
+	i = roaring_search(self, n >> 16);
+	if (i >= self->n || self->containers[i].key != n >> 16){
+		return;
+	}
+	if (container_remove(self->containers + i, n & 0xffff) == 1){
+		self->count -= 1;
+		if (!self->containers[i].card){
+			roaring_erase(self, i);
+		}
+	}
+}
+
+void fluff_set_roaring_optimize(struct FluffSetRoaring * self){
+	uint64_t words[CHUNK_WORDS];
+	struct RoaringContainer * c;
+	uint32_t i, runs;
+	void * ptr;
+	int kind;
+
+	for (i = 0; i < self->n; ++i){
+		c = self->containers + i;
+		if (c->kind == KIND_RUN){
+			runs = c->n;
+		} else {
+			container_to_words(c, words);
+			runs = words_count_runs(words);
+		}
+		kind = container_best_kind(c->card, runs);
+		if (kind != c->kind){
+			container_convert(c, kind);
+		} else if (kind != KIND_BITMAP && c->cap > c->n){
+			/* Give back the room left for growth */
+			ptr = MM->f_realloc(c->u.ptr, kind == KIND_ARRAY
+					? ARRAY_BYTES(c->n) : RUN_BYTES(c->n));
+			if (ptr){
+				c->u.ptr = ptr;
+				c->cap = c->n;
+			}
+		}
+	}
+	if (self->cap > self->n && self->n){
+		ptr = MM->f_realloc(self->containers,
+				self->n * sizeof(struct RoaringContainer));
+		if (ptr){
+			self->containers = ptr;
+			self->cap = self->n;
+		}
+	}
+}
+
+/*
+ * Store op of a and b in dest, which must be empty and may be a
+ * Containers of a which dest keeps are moved when dest is a, and copied
+ * otherwise. On failure dest is left empty, and a is unchanged
+ */
+static int roaring_apply(struct FluffSetRoaring * dest,
+		struct FluffSetRoaring * a, struct FluffSetRoaring * b, int op){
+	struct FluffSetRoaring result;
+	struct RoaringContainer * c;
+	uint32_t i, j, k;
+	int res;
+
+	result.n = result.cap = 0;
+	result.count = 0;
+	result.containers = NULL;
+	i = j = 0;
+	res = 0;
+	while (res >= 0 && (i < a->n || j < b->n)){
+		if (j >= b->n || (i < a->n
+				&& a->containers[i].key < b->containers[j].key)){
+			c = a->containers + i++;
+			if (!(op & KEEP_A)){
+				continue;
+			}
+		} else if (i >= a->n || b->containers[j].key < a->containers[i].key){
+			c = b->containers + j++;
+			if (!(op & KEEP_B)){
+				continue;
+			}
+		} else {
+			c = NULL;
+		}
+		if ((res = roaring_reserve(&result, result.n + 1))){
+			break;
+		}
+		if (!c){
+			res = container_op(result.containers + result.n,
+					a->containers + i++, b->containers + j++, op);
+		} else if (dest == a && c >= a->containers && c < a->containers + a->n){
+			result.containers[result.n] = *c;
+			c->u.ptr = NULL;
+		} else {
+			res = container_copy(result.containers + result.n, c);
+		}
+		if (!res){
+			result.count += result.containers[result.n].card;
+			result.n += 1;
+		}
+	}
+	if (res < 0){
+		/* Give moved containers back to a before freeing the rest */
+		for (k = 0; dest == a && k < result.n; ++k){
+			for (i = 0; i < a->n; ++i){
+				if (a->containers[i].key == result.containers[k].key
+						&& !a->containers[i].u.ptr){
+					a->containers[i].u.ptr = result.containers[k].u.ptr;
+					result.containers[k].u.ptr = NULL;
+				}
+			}
+		}
+		roaring_clear(&result);
+		if (result.containers){
+			MM->f_free(result.containers);
+		}
+		return -1;
+	}
+	if (dest == a){
+		roaring_clear(a);
+		if (a->containers){
+			MM->f_free(a->containers);
+		}
+	}
+	*dest = result;
+	return 0;
+}
+
+static struct FluffSetRoaring * roaring_apply_new(
+		struct FluffSetRoaring * a, struct FluffSetRoaring * b, int op){
+	struct FluffSetRoaring * self;
+
+	if ((self = fluff_set_roaring_new()) && roaring_apply(self, a, b, op)){
+		fluff_set_roaring_free(self);
+		self = NULL;
+	}
+	return self;
+}
+
+void fluff_set_roaring_union(
+		struct FluffSetRoaring * self, struct FluffSetRoaring * other){
+	roaring_apply(self, self, other, OP_OR);
+}
+
+void fluff_set_roaring_intersection(
+		struct FluffSetRoaring * self, struct FluffSetRoaring * other){
+	roaring_apply(self, self, other, OP_AND);
+}
+
+void fluff_set_roaring_difference(
+		struct FluffSetRoaring * self, struct FluffSetRoaring * other){
+	roaring_apply(self, self, other, OP_ANDNOT);
+}
+
+void fluff_set_roaring_symmetric_difference(
+		struct FluffSetRoaring * self, struct FluffSetRoaring * other){
+	roaring_apply(self, self, other, OP_XOR);
+}
+
+struct FluffSetRoaring * fluff_set_roaring_union_new(
+		struct FluffSetRoaring * a, struct FluffSetRoaring * b){
+	return roaring_apply_new(a, b, OP_OR);
+}
+
+struct FluffSetRoaring * fluff_set_roaring_intersection_new(
+		struct FluffSetRoaring * a, struct FluffSetRoaring * b){
+	return roaring_apply_new(a, b, OP_AND);
+}
+
+struct FluffSetRoaring * fluff_set_roaring_difference_new(
+		struct FluffSetRoaring * a, struct FluffSetRoaring * b){
+	return roaring_apply_new(a, b, OP_ANDNOT);
+}
+
+struct FluffSetRoaring * fluff_set_roaring_symmetric_difference_new(
+		struct FluffSetRoaring * a, struct FluffSetRoaring * b){
+	return roaring_apply_new(a, b, OP_XOR);
+}
+
+/*
+ * Iterator
+ */
+
+/*
+ * Start the container at the iterator's index
+ */
+static void roaring_iter_enter(struct FluffSetRoaringIter * self){
+	struct RoaringContainer * c;
+
+	self->pos = 0;
+	self->word = 0;
+	if (self->index < self->set->n){
+		c = self->set->containers + self->index;
+		if (c->kind == KIND_RUN){
+			self->value = c->u.runs[0].start;
+		}
+	}
+}
+
+struct FluffSetRoaringIter * fluff_set_roaring_iter(
+		struct FluffSetRoaring * set){
+	struct FluffSetRoaringIter * self;
+
+	if ((self = MM->f_alloc(roaringiter_size))){
+		self->set = set;
+		self->index = 0;
+		roaring_iter_enter(self);
+	}
+	return self;
+}
+
+void fluff_set_roaring_iter_free(struct FluffSetRoaringIter * self){
+	MM->f_free(self);
+}
+
+int fluff_set_roaring_iter_next(
+		struct FluffSetRoaringIter * self, uint32_t * dest){
+	struct RoaringContainer * c;
+	uint32_t low;
+
+	for (; self->index < self->set->n; ++self->index, roaring_iter_enter(self)){
+		c = self->set->containers + self->index;
+		switch (c->kind){
+		case KIND_ARRAY:
+			if (self->pos >= c->n){
+				continue;
+			}
+			low = c->u.array[self->pos++];
+			break;
+		case KIND_BITMAP:
+			while (!self->word && self->pos < CHUNK_WORDS){
+				self->word = c->u.bitmap[self->pos++];
+			}
+			if (!self->word){
+				continue;
+			}
+			low = (self->pos - 1) * 64 + __builtin_ctzll(self->word);
+			self->word &= self->word - 1;
+			break;
+		default:
+			if (self->pos >= c->n){
+				continue;
+			}
+			low = self->value;
+			if (low == c->u.runs[self->pos].last){
+				if (++self->pos < c->n){
+					self->value = c->u.runs[self->pos].start;
+				}
+			} else {
+				self->value += 1;
+			}
+			break;
+		}
+		if (dest){
+			*dest = (uint32_t)c->key << 16 | low;
+		}
+		return 1;
+	}
+	return 0;
+}
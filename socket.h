@@ -20,6 +20,7 @@
 #define FLUFF_SOCKET_H_
 
 #include "data.h"
+#include "mm.h"
 
 /*
  * Socket object
@@ -169,4 +170,9 @@ int fluff_socket_iter_next(
  */
 void fluff_socket_iter_free(struct FluffSocketIter *);
 
+/*
+ * Set the memory manager used by this module
+ */
+void fluff_socket_setmm(const struct FluffMM *);
+
 #endif /* FLUFF_SOCKET_H_ */
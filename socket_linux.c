@@ -86,7 +86,11 @@ static void setup_mm(){
     mm_need_setup = 0;
 }
 
-#define ENSURE_MM if (mm_need_setup) setup_mm();
+static void __attribute__((constructor)) init_mm(){
+	if (mm_need_setup){
+		setup_mm();
+	}
+}
 
 void fluff_socket_setmm(const struct FluffMM * mm){
 	if (!mm_need_setup){
@@ -128,8 +132,6 @@ static int set_blocking(int sock, int blocking){
 static struct FluffSocket * socket_new(int sock){
 	struct FluffSocket * self = NULL;
 
-	ENSURE_MM;
-
 	if (!fluff_traceback_grab("socket_new")){
 		if ((self = MM->f_alloc(socket_size))){
 			self->sock = sock;
@@ -168,8 +170,6 @@ static struct FluffSocketAddr * addr_fromsockaddr(
 		struct sockaddr * src){
 	struct FluffSocketAddr * self = NULL;
 
-	ENSURE_MM;
-
 	if (!fluff_traceback_grab("addr_fromsockaddr")){
 		if ((self = MM->f_alloc(addr_size))){
 			switch (src->sa_family){
@@ -205,8 +205,6 @@ static struct FluffSocketAddr * addr_fromsockaddr(
 struct FluffSocketAddr * fluff_socket_addr(char * host, uint16_t port){
 	struct FluffSocketAddr * self = NULL;
 
-	ENSURE_MM;
-
 	if (!fluff_traceback_grab("fluff_socket_addr")){
 		if ((self = MM->f_alloc(addr_size))){
 			self->port = port;
@@ -232,8 +230,6 @@ struct FluffSocket * fluff_socket_bind(
 	int true_val = 1;
 	int sock = -1;
 
-	ENSURE_MM;
-
 	if (!fluff_traceback_grab("fluff_socket_bind")){
 		memset(&hints, 0, sizeof(struct addrinfo));
 		hints.ai_family = AF_UNSPEC;
@@ -286,8 +282,6 @@ struct FluffSocket * fluff_socket_connect(
 	int sock = -1;
 	struct FluffSocket * self = NULL, * nself;
 
-	ENSURE_MM;
-
 	if (!fluff_traceback_grab("fluff_socket_connect")){
 		memset(&hints, 0, sizeof(struct addrinfo));
 		hints.ai_family = AF_UNSPEC;
@@ -506,8 +500,6 @@ struct FluffSocketSet * fluff_socket_set_new(){
 	struct FluffSocketSet * self = NULL;
 	int epfd;
 
-	ENSURE_MM;
-
 	if (!fluff_traceback_grab("fluff_socket_set_new")){
 		if ((self = MM->f_alloc(set_size))){
 			self->epfd = epfd = epoll_create(EPOLL_CREATE_SIZE);
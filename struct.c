@@ -54,7 +54,20 @@ static void setup_mm(){
     mm_need_setup = 0;
 }
 
-#define ENSURE_MM if (mm_need_setup) setup_mm();
+static void __attribute__((constructor)) init_mm(){
+	if (mm_need_setup){
+		setup_mm();
+	}
+}
+
+void fluff_struct_setmm(const struct FluffMM * mm){
+	if (!mm_need_setup){
+		MM->f_type_free(struct_size);
+		mm_need_setup = 1;
+	}
+	MM = mm;
+	setup_mm();
+}
 
 static int get_digit(char c, unsigned int * dest){
 	char * sc;
@@ -81,8 +94,6 @@ struct FluffStruct * fluff_struct_new(char * fmt){
 	struct FluffStruct * self;
 	struct Member * members;
 
-	ENSURE_MM;
-
 	iter = fmt;
 	while ((c = *iter++)){
 		switch (c) {
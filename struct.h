@@ -20,6 +20,7 @@
 #define FLUFF_STRUCT_H_
 
 #include "data.h"
+#include "mm.h"
 
 /*
  * Format | Standard type | Native type   | Size
@@ -60,4 +61,9 @@ void fluff_struct_unpack_vn(struct FluffStruct *, void * buf, va_list args);
 void fluff_struct_unpack_s(struct FluffStruct *, void * buf, void * struct_);
 void fluff_struct_unpack_sn(struct FluffStruct *, void * buf, void * struct_);
 
+/*
+ * Set the memory manager used by this module
+ */
+void fluff_struct_setmm(const struct FluffMM *);
+
 #endif /* FLUFF_STRUCT_H_ */
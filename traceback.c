@@ -40,9 +40,14 @@ static void setup_mm(){
 		MM = fluff_mm_system;
 	}
 	tb_size = MM->f_type_new(sizeof(struct Traceback));
+	mm_need_setup = 0;
 }
 
-#define ENSURE_MM if (mm_need_setup) setup_mm();
+static void __attribute__((constructor)) init_mm(){
+	if (mm_need_setup){
+		setup_mm();
+	}
+}
 
 void fluff_traceback_setmm(const struct FluffMM * mm){
 	if (!mm_need_setup){